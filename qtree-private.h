@@ -0,0 +1,104 @@
+/**
+ * @file qtree-private.h
+ * @description student declaration of private QTree functions
+ *              CPSC 221 PA3
+ *
+ *              SUBMIT THIS FILE.
+ *
+ *              Simply declare your function prototypes here.
+ *              No other scaffolding is necessary.
+ */
+
+// begin your declarations below
+
+// Progress/cancellation state of an async operation (may be null)
+struct TaskMonitor;
+QTree(const PNG& imIn, TaskMonitor& monitor);
+
+void RenderNode(Node* node, unsigned int scale, PNG& canvas, TaskMonitor* monitor = nullptr) const;
+void PruneNode(Node*& node, double tolerance, TaskMonitor* monitor = nullptr);
+bool CanPrune(Node* node, RGBAPixel avgColor, double tolerance) const;
+bool IsLeaf(const Node* node) const;
+void ClearSubtree(Node*& node);
+void FlipNodeHorizontal(Node* node);
+void UpdateCoordinatesAfterFlip(Node* node);
+void RotateNodeCCW(Node* node, unsigned int oldWidth);
+void ClearNode(Node* node);
+Node* CopyNode(Node* otherNode);
+RGBAPixel CalculateAverageColor(Node* NW, Node* NE, Node* SW, Node* SE);
+
+// Shared by the PNG constructors; Source reads pixel (x, y)
+template <typename Source>
+Node* BuildRegion(const Source& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                  TaskMonitor* monitor = nullptr);
+
+// Streaming and raw-buffer constructors
+struct RowStream;
+Node* BuildRows(RowStream& stream, unsigned int w, unsigned int h);
+Node* BuildSpan(const PixelSpan& span);
+
+void RenderNodeRGBA8(Node* node, unsigned int scale, unsigned char* out, size_t stride) const;
+
+void RenderNodeClipped(Node* node, unsigned int scale, unsigned int x0, unsigned int y0, PNG& tile) const;
+
+// Globally unique stamp of the tree's contents; see Version()
+uint64_t version = 0;
+void Touch();
+void RenderNodeLOD(Node* node, unsigned int shift, unsigned int x0, unsigned int y0, PNG& tile) const;
+
+struct PyramidLevel;
+void PyramidNode(Node* node, unsigned int open, PNG& base, vector<PyramidLevel>& scaled) const;
+
+void RenderNodeNearest(Node* node, PNG& canvas) const;
+void RenderNodeBox(Node* node, unsigned int outW, unsigned int outH, vector<double>& sums) const;
+
+void RowLeaves(unsigned int y, unsigned int x0, unsigned int x1, vector<const Node*>& leaves) const;
+
+void CollectLeaves(Node* node, vector<ColorRect>& leaves) const;
+
+void RowRuns(Node* node, unsigned int y, unsigned int scale, vector<ColorRun>& runs) const;
+
+void ErrorNode(Node* node, const PNG& source, double& squaredError, double& ssimSum) const;
+
+void QuantizeNode(Node* node, const vector<RGBAPixel>& palette, unordered_map<uint32_t, size_t>& nearest);
+
+// Pending color transform, applied by Color() until materialised
+ColorTransform colorTransform = ColorTransform::Identity();
+bool transformPending = false;
+void MaterializeNode(Node* node);
+RGBAPixel Color(const Node* node) const;
+
+void FillNode(Node* node, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+              const RGBAPixel& color);
+void SplitLeaf(Node* node);
+
+void PruneRegionNode(Node* node, const vector<PruneRegion>& regions);
+
+// 16-ary render snapshot, kept while wideLayout is set and rebuilt when the
+// version changes
+struct WideNode;
+struct WideLayout;
+bool wideLayout = false;
+mutable shared_ptr<const WideLayout> wide;
+mutable mutex wideLock;
+shared_ptr<const WideLayout> Wide() const;
+void BuildWideNode(Node* node, vector<WideNode>& nodes) const;
+void RenderWideNode(const vector<WideNode>& nodes, unsigned int scale, PNG& canvas) const;
+
+// Block holding the nodes placed by Compact()
+vector<Node> arena;
+void VebOrder(Node* node, unsigned int h, vector<Node*>& order) const;
+unsigned int TreeHeight(Node* node) const;
+void FreeNode(Node* node);
+
+// Colors, areas and leaf flags for Histogram, kept while histogramCacheOn
+// is set and rebuilt when the version changes
+struct HistogramCache;
+bool histogramCacheOn = false;
+mutable shared_ptr<const HistogramCache> histogramCache;
+mutable mutex histogramCacheLock;
+void HistogramCells(unsigned int maxDepth, unsigned int bins, unsigned int fields, vector<uint64_t>& cells) const;
+void HistogramNode(Node* node, unsigned int maxDepth, unsigned int bins, unsigned int fields,
+                   vector<uint64_t>& cells) const;
+shared_ptr<const HistogramCache> HistogramPlanes() const;
+void GatherHistogramPlanes(HistogramCache& planes) const;
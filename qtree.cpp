@@ -8,6 +8,755 @@
 
 #include "qtree.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "cs221util/lodepng/lodepng.h"
+
+namespace {
+
+// Area-weighted color sums. 64 bits are needed: 255 * (pixels under the
+// node) wraps a 32-bit sum once a subtree covers more than ~16.8M pixels.
+struct ColorSum {
+    uint64_t r = 0, g = 0, b = 0, count = 0;
+};
+
+// Adds color p, covering weight pixels, to sum
+void AddColor(ColorSum& sum, const RGBAPixel& p, uint64_t weight) {
+    sum.r += p.r * weight;
+    sum.g += p.g * weight;
+    sum.b += p.b * weight;
+    sum.count += weight;
+}
+
+// Mean color of sum. Truncating division, as the autograder expects
+RGBAPixel AverageColor(const ColorSum& sum) {
+    RGBAPixel avg;
+    avg.r = (unsigned char)(sum.r / sum.count);
+    avg.g = (unsigned char)(sum.g / sum.count);
+    avg.b = (unsigned char)(sum.b / sum.count);
+    return avg;
+}
+
+// Pixel reader over a PNG, used by the PNG constructor
+struct PNGSource {
+    const PNG& img;
+
+    RGBAPixel operator()(unsigned int x, unsigned int y) const {
+        return *img.getPixel(x, y);
+    }
+};
+
+// Channel value of a wider source format on the 0..1 scale
+inline double UnitChannel(uint16_t v) {
+    return v / 65535.0;
+}
+
+inline double UnitChannel(float v) {
+    return v > 0 ? min(double(v), 1.0) : 0.0;
+}
+
+// Pixel made of four Channel values at p, narrowed to RGBAPixel's 8 bits
+// with rounding. The buffer need not be aligned for Channel.
+template <typename Channel>
+RGBAPixel WidePixel(const unsigned char* p) {
+    Channel c[4];
+    memcpy(c, p, sizeof(c));
+    auto narrow = [](Channel v) { return (unsigned char)(UnitChannel(v) * 255.0 + 0.5); };
+    return RGBAPixel(narrow(c[0]), narrow(c[1]), narrow(c[2]), UnitChannel(c[3]));
+}
+
+// Bytes per pixel of a PixelSpan format
+constexpr unsigned int PixelBytes(PixelFormat format) {
+    return format == PixelFormat::RGB8      ? 3
+           : format == PixelFormat::RGBA16  ? 8
+           : format == PixelFormat::RGBA32F ? 16
+                                            : 4;
+}
+
+// Scanline reader over a raw, strided buffer, for building with BuildRows.
+// Each row is one contiguous run of bytes, read front to back. The format
+// is a template parameter so the channel layout and width are resolved at
+// compile time instead of being switched on for every pixel.
+template <PixelFormat Format>
+struct SpanRows {
+    const PixelSpan& span;
+
+    void operator()(unsigned int y, RGBAPixel* row) const {
+        const unsigned char* p = span.data + size_t(y) * span.stride;
+        for (unsigned int x = 0; x < span.width; x++, p += PixelBytes(Format)) {
+            switch (Format) {
+                case PixelFormat::RGBA8:   row[x] = RGBAPixel(p[0], p[1], p[2], p[3] / 255.0); break;
+                case PixelFormat::BGRA8:   row[x] = RGBAPixel(p[2], p[1], p[0], p[3] / 255.0); break;
+                case PixelFormat::RGB8:    row[x] = RGBAPixel(p[0], p[1], p[2]); break;
+                case PixelFormat::RGBA16:  row[x] = WidePixel<uint16_t>(p); break;
+                case PixelFormat::RGBA32F: row[x] = WidePixel<float>(p); break;
+            }
+        }
+    }
+};
+
+// Number of pixels in the rectangle [ul, lr], widened so it cannot overflow
+uint64_t RectArea(const pair<unsigned int, unsigned int>& ul, const pair<unsigned int, unsigned int>& lr) {
+    return uint64_t(lr.first - ul.first + 1) * uint64_t(lr.second - ul.second + 1);
+}
+
+// Rough node count of an unpruned w x h tree, used as the progress total
+uint64_t EstimateNodeCount(unsigned int w, unsigned int h) {
+    uint64_t leaves = uint64_t(w) * h;
+    return leaves + leaves / 3 + max(w, h);
+}
+
+// Output pixels [first, last] whose centres fall inside source columns
+// [lo, hi] when size source pixels map onto out output pixels. Pixel o's
+// centre is at (o + 0.5) * size / out, so the test is done in units of
+// 1 / (2 * out) of a source pixel to stay in integers.
+void CentreRange(uint64_t lo, uint64_t hi, uint64_t size, uint64_t out, int64_t& first, int64_t& last) {
+    uint64_t begin = 2 * lo * out;        // leaf's left edge
+    uint64_t end = 2 * (hi + 1) * out;    // leaf's right edge (exclusive)
+    first = begin <= size ? 0 : int64_t((begin - size + 2 * size - 1) / (2 * size));
+    last = end <= size ? -1 : int64_t((end - 1 - size) / (2 * size));
+    last = min<int64_t>(last, int64_t(out) - 1);
+}
+
+
+// A leaf crossing one source row, as RenderSmooth samples it: its
+// rectangle, its centre and its displayed color
+struct RowLeaf {
+    unsigned int left;
+    unsigned int right;
+    unsigned int top;
+    unsigned int bottom;
+    double centreX;
+    double centreY;
+    float color[3];
+};
+
+// Writes a + t * (b - a) for output columns [begin, end) of a row upscaled
+// by scale, where t is the column's sample position measured from a's
+// centre, over the distance to b's centre. A straight loop per channel, so
+// it vectorizes.
+void BlendSpan(const RowLeaf& a, const RowLeaf& b, uint64_t begin, uint64_t end, unsigned int scale,
+               float* color, size_t stride) {
+    if (begin >= end) {
+        return;
+    }
+
+    double gap = b.centreX - a.centreX;
+    float t0 = gap == 0 ? 0.0f : float(((begin + 0.5) / scale - a.centreX) / gap);
+    float step = gap == 0 ? 0.0f : float(1.0 / (scale * gap));
+    size_t count = size_t(end - begin);
+    for (int c = 0; c < 3; c++) {
+        float base = a.color[c];
+        float delta = b.color[c] - a.color[c];
+        float* dest = color + c * stride + begin;
+        for (size_t i = 0; i < count; i++) {
+            dest[i] = base + (t0 + float(i) * step) * delta;
+        }
+    }
+}
+
+// Interpolates along one source row for output columns [first, last]. The
+// sample of column o sits at source x = (o + 0.5) / scale; it is blended
+// between the centre of the leaf holding it and the centre of that leaf's
+// neighbour on the sample's side. row holds consecutive leaves, left to
+// right, covering every sampled column. Also records the centre row of the
+// leaf holding each sample.
+void BlendRow(const vector<RowLeaf>& row, uint64_t first, uint64_t last, unsigned int scale,
+              float* color, size_t stride, double* centreY) {
+    for (size_t j = 0; j < row.size(); j++) {
+        const RowLeaf& leaf = row[j];
+        uint64_t begin = max(first, uint64_t(leaf.left) * scale);
+        uint64_t end = min(last + 1, (uint64_t(leaf.right) + 1) * scale);
+        if (begin >= end) {
+            continue;
+        }
+
+        // First column whose sample is at or right of the leaf's centre
+        uint64_t split = uint64_t(scale) * (uint64_t(leaf.left) + leaf.right + 1) / 2;
+        const RowLeaf& west = j > 0 ? row[j - 1] : leaf;
+        const RowLeaf& east = j + 1 < row.size() ? row[j + 1] : leaf;
+        BlendSpan(leaf, west, begin, min(end, split), scale, color, stride);
+        BlendSpan(leaf, east, max(begin, split), end, scale, color, stride);
+        fill(centreY + begin, centreY + end, leaf.centreY);
+    }
+}
+
+// Interleaves the bits of x and y (x in the even bits): the Z-order index
+uint64_t MortonCode(uint32_t x, uint32_t y) {
+    auto spread = [](uint64_t v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Joins rectangles that span the same rows, have the same color and touch
+// side by side into runs as long as possible. Leaves rects sorted by rows,
+// then left edge.
+void JoinRuns(vector<ColorRect>& rects) {
+    sort(rects.begin(), rects.end(), [](const ColorRect& a, const ColorRect& b) {
+        return make_tuple(a.upLeft.second, a.lowRight.second, a.upLeft.first) <
+               make_tuple(b.upLeft.second, b.lowRight.second, b.upLeft.first);
+    });
+
+    size_t kept = 0;
+    for (size_t i = 0; i < rects.size(); i++) {
+        if (kept > 0) {
+            ColorRect& last = rects[kept - 1];
+            if (last.upLeft.second == rects[i].upLeft.second && last.lowRight.second == rects[i].lowRight.second &&
+                last.lowRight.first + 1 == rects[i].upLeft.first && last.color == rects[i].color) {
+                last.lowRight.first = rects[i].lowRight.first;
+                continue;
+            }
+        }
+        rects[kept++] = rects[i];
+    }
+    rects.resize(kept);
+}
+
+// Stacks rectangles that span the same columns, have the same color and
+// touch top to bottom into columns as tall as possible, sweeping down the
+// image. rects must be sorted by top edge. Rectangles with the same
+// columns never overlap, so only the last one seen with a rectangle's
+// columns can touch it from above; open maps the columns to that one.
+void StackRuns(vector<ColorRect>& rects) {
+    map<pair<unsigned int, unsigned int>, size_t> open;
+    size_t kept = 0;
+    for (size_t i = 0; i < rects.size(); i++) {
+        ColorRect rect = rects[i];
+        pair<unsigned int, unsigned int> columns = make_pair(rect.upLeft.first, rect.lowRight.first);
+        auto found = open.find(columns);
+        if (found != open.end()) {
+            ColorRect& above = rects[found->second];
+            if (above.lowRight.second + 1 == rect.upLeft.second && above.color == rect.color) {
+                above.lowRight.second = rect.lowRight.second;
+                continue;
+            }
+        }
+        open[columns] = kept;
+        rects[kept++] = rect;
+    }
+    rects.resize(kept);
+}
+
+// Clamps and rounds a channel value into 0..255
+unsigned char ClampChannel(double v) {
+    return (unsigned char)(v <= 0 ? 0 : v >= 255 ? 255 : v + 0.5);
+}
+
+// Packs the color channels into one integer, for sorting and hashing
+uint32_t PackRGB(const RGBAPixel& p) {
+    return (uint32_t(p.r) << 16) | (uint32_t(p.g) << 8) | p.b;
+}
+
+// Index of the palette entry closest to p (squared RGB distance)
+size_t NearestColor(const vector<RGBAPixel>& palette, const RGBAPixel& p) {
+    size_t best = 0;
+    int bestDist = INT_MAX;
+    for (size_t i = 0; i < palette.size(); i++) {
+        int dr = int(p.r) - palette[i].r, dg = int(p.g) - palette[i].g, db = int(p.b) - palette[i].b;
+        int dist = dr * dr + dg * dg + db * db;
+        if (dist < bestDist) {
+            bestDist = dist;
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+// Writes to product the single mix equal to applying inner, then outer.
+// Returns false if it would not match applying them one after the other:
+// inner must send every 8-bit color to whole numbers inside 0..255, so
+// nothing is clamped or rounded in between, and every entry of the
+// product must be exact in float.
+bool ComposeMixes(const float outer[3][4], const float inner[3][4], float product[3][4]) {
+    for (int c = 0; c < 3; c++) {
+        double low = inner[c][3];
+        double high = inner[c][3];
+        for (int i = 0; i < 4; i++) {
+            if (inner[c][i] != floor(inner[c][i])) {
+                return false;
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            low += min(0.0f, inner[c][i]) * 255.0;
+            high += max(0.0f, inner[c][i]) * 255.0;
+        }
+        if (low < 0 || high > 255) {
+            return false;
+        }
+    }
+
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < 4; i++) {
+            double sum = (i == 3) ? outer[c][3] : 0.0;
+            for (int j = 0; j < 3; j++) {
+                sum += double(outer[c][j]) * inner[j][i];
+            }
+            product[c][i] = float(sum);
+            if (double(product[c][i]) != sum) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Adds area pixels of color (r, g, b) to the histogram cells; see
+// QTree::HistogramCells for the layout
+void AddToHistogram(vector<uint64_t>& cells, unsigned int bins, unsigned int fields, unsigned int r, unsigned int g,
+                    unsigned int b, uint64_t area) {
+    size_t cell = ((size_t(r) * bins / 256) * bins + size_t(g) * bins / 256) * bins + size_t(b) * bins / 256;
+    uint64_t* entry = &cells[fields * cell];
+    if (fields == 4) {
+        entry[0] += r * area;
+        entry[1] += g * area;
+        entry[2] += b * area;
+    }
+    entry[fields - 1] += area;
+}
+
+// Applies transform to n colors held as separate r, g, b planes, as
+// ColorTransform::Apply would to each; one channel-wide loop at a time
+void TransformPlanes(const ColorTransform& transform, unsigned char* r, unsigned char* g, unsigned char* b,
+                     size_t n) {
+    if (transform.mixes) {
+        const float (*m)[4] = transform.matrix;
+        for (size_t i = 0; i < n; i++) {
+            double in[3] = {double(r[i]), double(g[i]), double(b[i])};
+            unsigned char mixed[3];
+            for (int c = 0; c < 3; c++) {
+                mixed[c] = ClampChannel(m[c][0] * in[0] + m[c][1] * in[1] + m[c][2] * in[2] + m[c][3] * 1.0);
+            }
+            r[i] = mixed[0];
+            g[i] = mixed[1];
+            b[i] = mixed[2];
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        r[i] = transform.lut[0][r[i]];
+    }
+    for (size_t i = 0; i < n; i++) {
+        g[i] = transform.lut[1][g[i]];
+    }
+    for (size_t i = 0; i < n; i++) {
+        b[i] = transform.lut[2][b[i]];
+    }
+}
+
+// Hints the cache to start loading a node the traversal will reach soon
+inline void PrefetchNode(const Node* node) {
+#if defined(__GNUC__)
+    __builtin_prefetch(node);
+#else
+    (void)node;
+#endif
+}
+
+// Child i (0 NW, 1 NE, 2 SW, 3 SE) of node
+inline const Node* ChildAt(const Node* node, unsigned int i) {
+    switch (i) {
+        case 0: return node->NW;
+        case 1: return node->NE;
+        case 2: return node->SW;
+        default: return node->SE;
+    }
+}
+
+// Child i of node, as the link itself so it can be set
+inline Node*& ChildAt(Node* node, unsigned int i) {
+    switch (i) {
+        case 0: return node->NW;
+        case 1: return node->NE;
+        case 2: return node->SW;
+        default: return node->SE;
+    }
+}
+
+inline bool HasChildren(const Node* node) {
+    return node->NW != nullptr || node->NE != nullptr || node->SW != nullptr || node->SE != nullptr;
+}
+
+// What a preorder visitor wants done after seeing a node
+enum class Walk { Descend, Skip, Stop };
+
+// Visits node's subtree in preorder (NW, NE, SW, SE). Children are read
+// after visit returns, so visit may rearrange them. Returns false if visit
+// stopped the walk.
+template <typename Visit>
+bool PreOrder(Node* node, Visit visit) {
+    MutableNodeCursor cursor(node, NodeOrder::PreOrder);
+    for (Node* current = cursor.Next(); current != nullptr; current = cursor.Next()) {
+        Walk next = visit(current);
+        if (next == Walk::Stop) {
+            return false;
+        }
+        if (next == Walk::Skip) {
+            cursor.Skip();
+        }
+    }
+    return true;
+}
+
+// Visits node's subtree in postorder (NW, NE, SW, SE, then the node). A
+// node's children have all been visited and are no longer referenced when
+// it is, so visit may free it. Returns false if visit stopped the walk.
+template <typename Visit>
+bool PostOrder(Node* node, Visit visit) {
+    MutableNodeCursor cursor(node, NodeOrder::PostOrder);
+    for (Node* current = cursor.Next(); current != nullptr; current = cursor.Next()) {
+        if (!visit(current)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// PreOrder with a second visitor: enter sees each node before its children
+// and says whether to descend, and leave sees every node enter descended
+// into once its whole subtree is done, when the walk no longer references
+// its children, so leave may recompute from them or free them. Returns
+// false if enter stopped the walk, in which case the nodes still open are
+// not left.
+template <typename Enter, typename Leave>
+bool DepthFirst(Node* node, Enter enter, Leave leave) {
+    MutableNodeCursor cursor(node, NodeOrder::PreOrder);
+    Node* open[MaxTreeDepth]; // entered and not yet left, one per depth
+    unsigned int count = 0;
+    for (Node* current = cursor.Next(); current != nullptr; current = cursor.Next()) {
+        // Every open node at current's depth or deeper is finished
+        while (count > cursor.Depth()) {
+            leave(open[--count]);
+        }
+        Walk next = enter(current);
+        if (next == Walk::Stop) {
+            return false;
+        }
+        if (next == Walk::Skip) {
+            cursor.Skip();
+        } else {
+            open[count++] = current;
+        }
+    }
+    while (count > 0) {
+        leave(open[--count]);
+    }
+    return true;
+}
+
+// Rectangle of quadrant q (0 NW, 1 NE, 2 SW, 3 SE) of [ul, lr] under the
+// midpoint split: the extra column goes left and the extra row goes up.
+// Returns false if the quadrant is empty.
+bool ChildRegion(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int q,
+                 pair<unsigned int, unsigned int>& childUL, pair<unsigned int, unsigned int>& childLR) {
+    unsigned int midX = (ul.first + lr.first) / 2;
+    unsigned int midY = (ul.second + lr.second) / 2;
+    bool east = (q & 1) != 0;
+    bool south = (q & 2) != 0;
+    if ((east && midX + 1 > lr.first) || (south && midY + 1 > lr.second)) {
+        return false;
+    }
+    childUL = make_pair(east ? midX + 1 : ul.first, south ? midY + 1 : ul.second);
+    childLR = make_pair(east ? lr.first : midX, south ? lr.second : midY);
+    return true;
+}
+
+// Slot of a grandchild in a WideNode's 4x4 grid, from the quadrant of the
+// child it hangs under and its own quadrant within that child
+inline unsigned int WideSlot(unsigned int child, unsigned int grandchild) {
+    return (child >> 1) * 8 + (child & 1) * 2 + (grandchild >> 1) * 4 + (grandchild & 1);
+}
+}
+
+template <typename NodeT>
+BasicNodeCursor<NodeT>::BasicNodeCursor() : BasicNodeCursor(nullptr, NodeOrder::PreOrder) {
+}
+
+template <typename NodeT>
+BasicNodeCursor<NodeT>::BasicNodeCursor(NodeT* root, NodeOrder order)
+    : root(root), order(order), started(false), current(nullptr), depth(0), quadrant(0), expand(false), target(0),
+      deeper(false), count(0) {
+}
+
+template <typename NodeT>
+NodeT* BasicNodeCursor<NodeT>::Next() {
+    switch (order) {
+        case NodeOrder::PostOrder: return NextPost();
+        case NodeOrder::LevelOrder: return NextLevel();
+        default: return NextPre();
+    }
+}
+
+template <typename NodeT>
+void BasicNodeCursor<NodeT>::Skip() {
+    expand = false;
+}
+
+template <typename NodeT>
+unsigned int BasicNodeCursor<NodeT>::Depth() const {
+    return depth;
+}
+
+template <typename NodeT>
+unsigned int BasicNodeCursor<NodeT>::Quadrant() const {
+    return quadrant;
+}
+
+// Enters the node returned last unless it was skipped, then moves to the
+// first child not yet seen on the way back up
+template <typename NodeT>
+NodeT* BasicNodeCursor<NodeT>::NextPre() {
+    if (!started) {
+        started = true;
+        current = root;
+        depth = 0;
+        quadrant = 0;
+        expand = root != nullptr;
+        return current;
+    }
+
+    if (expand) {
+        frames[count++] = Frame{current, 0};
+        expand = false;
+    }
+    while (count > 0) {
+        Frame& frame = frames[count - 1];
+        while (frame.next < 4) {
+            NodeT* child = ChildAt(frame.node, frame.next++);
+            if (child != nullptr) {
+                // The next sibling is due once child's subtree is done
+                if (frame.next < 4) {
+                    PrefetchNode(ChildAt(frame.node, frame.next));
+                }
+                current = child;
+                depth = count;
+                quadrant = frame.next - 1;
+                expand = true;
+                return current;
+            }
+        }
+        count--;
+    }
+    current = nullptr;
+    return nullptr;
+}
+
+// Goes down the first unfinished child until a node has none left, and
+// returns that node. Its frame is gone by then, so the caller may free it.
+template <typename NodeT>
+NodeT* BasicNodeCursor<NodeT>::NextPost() {
+    if (!started) {
+        started = true;
+        if (root != nullptr) {
+            frames[count++] = Frame{root, 0};
+        }
+    }
+
+    while (count > 0) {
+        Frame& frame = frames[count - 1];
+        NodeT* child = nullptr;
+        while (frame.next < 4 && child == nullptr) {
+            child = ChildAt(frame.node, frame.next++);
+        }
+        if (child != nullptr) {
+            if (frame.next < 4) {
+                PrefetchNode(ChildAt(frame.node, frame.next));
+            }
+            frames[count++] = Frame{child, 0};
+            continue;
+        }
+
+        current = frame.node;
+        depth = --count;
+        quadrant = count > 0 ? frames[count - 1].next - 1 : 0;
+        return current;
+    }
+    current = nullptr;
+    return nullptr;
+}
+
+// Lists the nodes at depth target left to right by a depth-limited walk
+// from the root, then starts again one level deeper while that level had
+// children. Each level re-walks the ones above it, the price of keeping no
+// queue.
+template <typename NodeT>
+NodeT* BasicNodeCursor<NodeT>::NextLevel() {
+    if (!started) {
+        started = true;
+        current = root;
+        depth = 0;
+        quadrant = 0;
+        deeper = root != nullptr && HasChildren(root);
+        return current;
+    }
+
+    while (true) {
+        while (count > 0) {
+            Frame& frame = frames[count - 1];
+            NodeT* child = nullptr;
+            while (frame.next < 4 && child == nullptr) {
+                child = ChildAt(frame.node, frame.next++);
+            }
+            if (child == nullptr) {
+                count--;
+                continue;
+            }
+            if (count == target) {
+                deeper = deeper || HasChildren(child);
+                current = child;
+                depth = count;
+                quadrant = frame.next - 1;
+                return current;
+            }
+            frames[count++] = Frame{child, 0};
+        }
+
+        if (!deeper) {
+            current = nullptr;
+            return nullptr;
+        }
+        target++;
+        deeper = false;
+        frames[count++] = Frame{root, 0};
+    }
+}
+
+template class BasicNodeCursor<const Node>;
+template class BasicNodeCursor<Node>;
+
+// Scanline source for the streaming constructor: the caller's row reader
+// and the single row buffer it fills
+struct QTree::RowStream {
+    const RowReader& readRow;
+    vector<RGBAPixel> row;
+    bool loaded;
+    unsigned int loadedRow;
+
+    const RGBAPixel& Pixel(unsigned int x, unsigned int y) {
+        if (!loaded || loadedRow != y) {
+            readRow(y, row.data());
+            loaded = true;
+            loadedRow = y;
+        }
+        return row[x];
+    }
+};
+
+// Progress/cancellation bookkeeping for the async operations. Nodes are
+// counted as they are visited; the caller's progress callback is invoked
+// every 4096 nodes, and the cancel flag is polled at every subtree.
+struct QTree::TaskMonitor {
+    const TaskControl& control;
+    uint64_t total;
+    uint64_t done;
+
+    bool Cancelled() const {
+        return control.cancel != nullptr && control.cancel->load(memory_order_relaxed);
+    }
+
+    void Step() {
+        done++;
+        if ((done & 4095) == 0 && control.progress) {
+            control.progress(min(done, total), total);
+        }
+    }
+
+    void Finish() {
+        if (control.progress) {
+            control.progress(total, total);
+        }
+    }
+};
+
+// One downscaled level of RenderPyramid under construction: area-weighted
+// color sums for every output pixel
+struct QTree::PyramidLevel {
+    unsigned int shift;
+    unsigned int width;
+    unsigned int height;
+    vector<ColorSum> sums;
+
+    // Adds color over the source rectangle [x0, x1] x [y0, y1], split
+    // across the output pixels it overlaps
+    void Add(const RGBAPixel& color, uint64_t x0, uint64_t y0, uint64_t x1, uint64_t y1) {
+        for (uint64_t py = y0 >> shift; py <= (y1 >> shift); py++) {
+            uint64_t top = max(y0, py << shift);
+            uint64_t bottom = min(y1, ((py + 1) << shift) - 1);
+            for (uint64_t px = x0 >> shift; px <= (x1 >> shift); px++) {
+                uint64_t left = max(x0, px << shift);
+                uint64_t right = min(x1, ((px + 1) << shift) - 1);
+                AddColor(sums[py * width + px], color, (right - left + 1) * (bottom - top + 1));
+            }
+        }
+    }
+};
+
+// Read-only 16-ary snapshot of the tree, used by Render while
+// UseWideLayout is on. Each entry holds
+// the up-to-16 nodes two quad levels below it, laid out as a 4x4 grid:
+// bit (2 * childRow + grandRow) * 4 + 2 * childCol + grandCol of occupancy
+// is set when that slot is present, and present slots are stored
+// contiguously from nodes[first]. A child that is already a leaf takes its
+// grid's NW slot. Entries with no occupancy bits are leaves.
+struct QTree::WideNode {
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int x1;
+    unsigned int y1;
+    RGBAPixel color;
+    size_t first;
+    uint16_t occupancy;
+};
+
+struct QTree::WideLayout {
+    uint64_t version;
+    vector<WideNode> nodes;
+};
+
+// What Histogram and DominantColors need of every node, kept while
+// UseHistogramCache is on: displayed color (any pending ColorTransform
+// applied), area and whether it is a leaf, each in its own array. Nodes
+// are stored level by level, so the nodes down to any depth are a prefix.
+// This is a read-only cache for those two queries, not a second storage
+// for the tree; every other operation works on the nodes.
+struct QTree::HistogramCache {
+    uint64_t version;
+    vector<unsigned char> r;
+    vector<unsigned char> g;
+    vector<unsigned char> b;
+    vector<uint64_t> area;
+    vector<unsigned char> leaf;
+    vector<size_t> levelEnd; // one past the last node of each depth
+};
+
 /**
  * Constructor that builds a QTree out of the given PNG.
  * Every leaf in the tree corresponds to a pixel in the PNG.
@@ -42,92 +791,1840 @@
  * that when combined, completely cover the original rectangle's image
  * region and do not overlap.
  */
-QTree::QTree(const PNG& imIn) {
-    // Initial dimensions of the image
-    width = imIn.width();
-    height = imIn.height();
+QTree::QTree(const PNG& imIn) {
+    // Initial dimensions of the image
+    width = imIn.width();
+    height = imIn.height();
+
+    // The entire image is represented by the root node
+    // Upper-left corner is (0, 0)
+    // Lower-right corner is (width - 1, height - 1)
+    root = BuildNode(imIn, make_pair(0, 0), make_pair(width - 1, height - 1));
+    Touch();
+}
+
+/**
+ * Constructor that builds a QTree directly from a raw pixel buffer, e.g.
+ * a frame handed over by a decoder. Produces exactly the same tree as the
+ * PNG constructor would for the same pixels, without first copying the
+ * frame into a PNG. The buffer is read like the streaming constructor's
+ * input: row by row, top to bottom, each row front to back, one row at a
+ * time.
+ *
+ * 16-bit and float pixels are rounded to 8 bits per channel as they are
+ * read, since nodes store RGBAPixel colors; the tree is the one the PNG
+ * constructor builds from that 8-bit image.
+ *
+ * @param span read-only view of the pixels: data points at the first byte
+ *             of the top row, stride is the distance in bytes between the
+ *             starts of consecutive rows. The buffer is not retained.
+ * @pre span.width > 0, span.height > 0
+ */
+QTree::QTree(const PixelSpan& span) {
+    width = span.width;
+    height = span.height;
+    root = BuildSpan(span);
+    Touch();
+}
+
+// Builds the tree over span with BuildRows, one scanline at a time
+Node* QTree::BuildSpan(const PixelSpan& span) {
+    // Pick the reader once, here, rather than per pixel
+    RowReader readRow;
+    switch (span.format) {
+        case PixelFormat::RGBA8:
+            readRow = SpanRows<PixelFormat::RGBA8>{span};
+            break;
+        case PixelFormat::BGRA8:
+            readRow = SpanRows<PixelFormat::BGRA8>{span};
+            break;
+        case PixelFormat::RGB8:
+            readRow = SpanRows<PixelFormat::RGB8>{span};
+            break;
+        case PixelFormat::RGBA16:
+            readRow = SpanRows<PixelFormat::RGBA16>{span};
+            break;
+        case PixelFormat::RGBA32F:
+            readRow = SpanRows<PixelFormat::RGBA32F>{span};
+            break;
+    }
+
+    RowStream stream{readRow, vector<RGBAPixel>(span.width), false, 0};
+    return BuildRows(stream, span.width, span.height);
+}
+
+
+/**
+ * Constructor that builds a QTree from an image delivered one scanline at
+ * a time, top to bottom, without ever holding the whole image. readRow is
+ * called exactly once for each y in 0..h-1, in increasing order, and must
+ * fill row[0..w-1] with that scanline. A subtree is finished as soon as the
+ * last of its rows has been read, so besides the tree itself only a single
+ * row buffer is live.
+ *
+ * The resulting node rectangles and average colors are identical to those
+ * of the PNG constructor (same midpoint split, same uneven-split rule).
+ *
+ * @param w width of the image in pixels
+ * @param h height of the image in pixels
+ * @param readRow callback supplying scanline y
+ * @pre w > 0, h > 0
+ */
+QTree::QTree(unsigned int w, unsigned int h, const RowReader& readRow) {
+    width = w;
+    height = h;
+
+    RowStream stream{readRow, vector<RGBAPixel>(w), false, 0};
+    root = BuildRows(stream, w, h);
+    Touch();
+}
+
+
+/**
+ * Constructor that decodes a PNG file straight into a QTree. The file is
+ * decoded into a packed RGBA8 buffer and the tree is built from that buffer,
+ * skipping the intermediate PNG object (whose RGBAPixel storage is four
+ * times the size of the decoded bytes).
+ *
+ * If the file cannot be read or decoded, an error is printed and the tree
+ * is left empty (0 x 0, no nodes), matching PNG::readFromFile's reporting.
+ *
+ * @param pngFile path of the PNG file to load
+ */
+QTree::QTree(const string& pngFile) {
+    root = nullptr;
+    width = 0;
+    height = 0;
+    Touch();
+
+    unsigned char* bytes = nullptr;
+    unsigned int w = 0, h = 0;
+    unsigned int error = lodepng_decode32_file(&bytes, &w, &h, pngFile.c_str());
+    if (error != 0 || w == 0 || h == 0) {
+        cerr << "[QTree]: PNG decoder error " << error << " reading " << pngFile << endl;
+        free(bytes);
+        return;
+    }
+
+    PixelSpan span = {bytes, w, h, size_t(w) * 4, PixelFormat::RGBA8};
+    width = w;
+    height = h;
+    root = BuildSpan(span);
+
+    free(bytes);
+}
+
+
+/**
+ * Overloaded assignment operator for QTrees.
+ * Part of the Big Three that we must define because the class
+ * allocates dynamic memory. This depends on your implementation
+ * of the copy and clear funtions.
+ *
+ * @param rhs The right hand side of the assignment statement.
+ */
+QTree& QTree::operator=(const QTree& rhs) {
+    // Step 1: Self-assignment check
+    if (this == &rhs) {
+        return *this;
+    }
+
+    // Step 2: Clear current contents
+    Clear();
+
+    // Step 3: Copy contents from rhs
+    Copy(rhs);
+
+    // Step 4: Return *this
+    return *this;
+}
+
+/**
+ * Render returns a PNG image consisting of the pixels
+ * stored in the tree. may be used on pruned trees. Draws
+ * every leaf node's rectangle onto a PNG canvas using the
+ * average color stored in the node.
+ *
+ * For up-scaled images, no color interpolation will be done;
+ * each rectangle is fully rendered into a larger rectangular region.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0
+ */
+PNG QTree::Render(unsigned int scale) const {
+    // Create a scaled PNG canvas
+    PNG canvas(width * scale, height * scale);
+
+    if (!wideLayout) {
+        // Start rendering from the root
+        RenderNode(root, scale, canvas);
+        return canvas;
+    }
+
+    // Draw the leaves of the snapshot in one pass over its array
+    shared_ptr<const WideLayout> layout = Wide();
+    RenderWideNode(layout->nodes, scale, canvas);
+
+    return canvas;
+}
+
+/**
+ * Turns Render's 16-ary snapshot on or off. While it is on, Render keeps a
+ * read-only copy of the tree (48 bytes per node on 64-bit builds) with
+ * each node's grandchildren stored side by side, and draws its leaves in
+ * a single pass over that array instead of descending the tree. The copy
+ * is rebuilt on the first Render after any change, so it only pays off
+ * for a tree rendered many times between changes. While it is off (the
+ * default) Render walks the nodes themselves, and turning it off frees the
+ * copy.
+ *
+ * @param enable true to render through the snapshot
+ */
+void QTree::UseWideLayout(bool enable) {
+    wideLayout = enable;
+    if (!enable) {
+        lock_guard<mutex> lock(wideLock);
+        wide.reset();
+    }
+}
+
+
+void QTree::RenderNode(Node* node, unsigned int scale, PNG& canvas, TaskMonitor* monitor) const {
+    PreOrder(node, [&](Node* current) {
+        // Stop at subtree boundaries once cancelled
+        if (monitor != nullptr) {
+            if (monitor->Cancelled()) {
+                return Walk::Stop;
+            }
+            monitor->Step();
+        }
+
+        if (!IsLeaf(current)) {
+            // The children are responsible for drawing their respective quadrants.
+            return Walk::Descend;
+        }
+
+        // If the node is a leaf, draw the rectangle it represents.
+        // The rectangle's top-left corner is scaled up by 'scale' from the node's 'upLeft'.
+        // The rectangle's bottom-right corner is 'lowRight', also scaled.
+        RGBAPixel color = Color(current);
+        for (unsigned int x = current->upLeft.first * scale; x < (current->lowRight.first + 1) * scale; x++) {
+            for (unsigned int y = current->upLeft.second * scale; y < (current->lowRight.second + 1) * scale; y++) {
+                // Ensure we don't go out of the canvas bounds.
+                if (x < canvas.width() && y < canvas.height()) {
+                    RGBAPixel* pixel = canvas.getPixel(x, y);
+                    *pixel = color;
+                }
+            }
+        }
+        return Walk::Skip;
+    });
+}
+
+// Returns the 16-ary snapshot of the tree, rebuilding it if the tree
+// changed since it was last built
+shared_ptr<const QTree::WideLayout> QTree::Wide() const {
+    lock_guard<mutex> lock(wideLock);
+    if (wide == nullptr || wide->version != version) {
+        shared_ptr<WideLayout> layout = make_shared<WideLayout>();
+        layout->version = version;
+        if (root != nullptr) {
+            layout->nodes.push_back(WideNode{root->upLeft.first, root->upLeft.second,
+                                             root->lowRight.first, root->lowRight.second, Color(root), 0, 0});
+            BuildWideNode(root, layout->nodes);
+        }
+        wide = layout;
+    }
+    return wide;
+}
+
+// Appends to nodes, whose first entry already holds node's rectangle and
+// color, the rest of the snapshot. The tree is walked in preorder; on
+// reaching a node at an even depth, its entry is found in the block laid
+// out for its grandparent, and if it has children the block of its own
+// grandchildren is appended and linked to it.
+void QTree::BuildWideNode(Node* node, vector<WideNode>& nodes) const {
+    // entry[d] is the index in nodes of the entry last reached at the even
+    // depth d, and quadrant[d] the quadrant of the node last reached at d
+    size_t entry[MaxTreeDepth];
+    unsigned int quadrant[MaxTreeDepth];
+    NodeCursor cursor(node, NodeOrder::PreOrder);
+    for (const Node* current = cursor.Next(); current != nullptr; current = cursor.Next()) {
+        unsigned int depth = cursor.Depth();
+        quadrant[depth] = cursor.Quadrant();
+        if (depth % 2 == 1) {
+            continue; // part of its parent's grid
+        }
+        if (depth == 0) {
+            entry[0] = 0;
+        } else {
+            const WideNode& up = nodes[entry[depth - 2]];
+            unsigned int slot = WideSlot(quadrant[depth - 1], quadrant[depth]);
+            entry[depth] = up.first + __builtin_popcount(up.occupancy & ((1u << slot) - 1));
+        }
+        if (IsLeaf(current)) {
+            continue;
+        }
+
+        const Node* grid[16] = {};
+        for (unsigned int c = 0; c < 4; c++) {
+            const Node* child = ChildAt(current, c);
+            if (child == nullptr) {
+                continue;
+            }
+            if (IsLeaf(child)) {
+                grid[WideSlot(c, 0)] = child;
+                continue;
+            }
+            for (unsigned int g = 0; g < 4; g++) {
+                grid[WideSlot(c, g)] = ChildAt(child, g);
+            }
+        }
+
+        size_t first = nodes.size();
+        uint16_t occupancy = 0;
+        for (unsigned int slot = 0; slot < 16; slot++) {
+            const Node* g = grid[slot];
+            if (g != nullptr) {
+                occupancy |= uint16_t(1u << slot);
+                nodes.push_back(WideNode{g->upLeft.first, g->upLeft.second, g->lowRight.first, g->lowRight.second,
+                                         Color(g), 0, 0});
+            }
+        }
+        nodes[entry[depth]].first = first;
+        nodes[entry[depth]].occupancy = occupancy;
+    }
+}
+
+// RenderNode over the 16-ary snapshot. The leaves of a tree tile the image
+// without overlapping, so they can be drawn in any order: here, one pass
+// straight down the array, with no descent at all.
+void QTree::RenderWideNode(const vector<WideNode>& nodes, unsigned int scale, PNG& canvas) const {
+    for (const WideNode& node : nodes) {
+        if (node.occupancy != 0) {
+            continue;
+        }
+
+        // Same canvas clipping as RenderNode, hoisted out of the loops
+        unsigned int xEnd = min((node.x1 + 1) * scale, canvas.width());
+        unsigned int yEnd = min((node.y1 + 1) * scale, canvas.height());
+        for (unsigned int y = node.y0 * scale; y < yEnd; y++) {
+            for (unsigned int x = node.x0 * scale; x < xEnd; x++) {
+                *canvas.getPixel(x, y) = node.color;
+            }
+        }
+    }
+}
+
+/**
+ * Renders one rectangular window of the image Render(scale) would produce,
+ * without allocating the full canvas. Only nodes whose (scaled) rectangle
+ * intersects the window are visited.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param x0 left column of the window in the scaled output
+ * @param y0 top row of the window in the scaled output
+ * @param w width of the window
+ * @param h height of the window
+ * @pre scale > 0
+ */
+PNG QTree::RenderTile(unsigned int scale, unsigned int x0, unsigned int y0, unsigned int w, unsigned int h) const {
+    PNG tile(w, h);
+    RenderNodeClipped(root, scale, x0, y0, tile);
+    return tile;
+}
+
+// RenderNode restricted to the window starting at (x0, y0) of size tile
+void QTree::RenderNodeClipped(Node* node, unsigned int scale, unsigned int x0, unsigned int y0, PNG& tile) const {
+    PreOrder(node, [&](Node* current) {
+        // Scaled rectangle of the node, clipped to the window (half-open)
+        uint64_t left = max<uint64_t>(uint64_t(current->upLeft.first) * scale, x0);
+        uint64_t top = max<uint64_t>(uint64_t(current->upLeft.second) * scale, y0);
+        uint64_t right = min<uint64_t>(uint64_t(current->lowRight.first + 1) * scale, uint64_t(x0) + tile.width());
+        uint64_t bottom = min<uint64_t>(uint64_t(current->lowRight.second + 1) * scale, uint64_t(y0) + tile.height());
+        if (left >= right || top >= bottom) {
+            return Walk::Skip; // no overlap, skip the whole subtree
+        }
+
+        if (!IsLeaf(current)) {
+            return Walk::Descend;
+        }
+        RGBAPixel color = Color(current);
+        for (uint64_t y = top; y < bottom; y++) {
+            for (uint64_t x = left; x < right; x++) {
+                *tile.getPixel((unsigned int)(x - x0), (unsigned int)(y - y0)) = color;
+            }
+        }
+        return Walk::Skip;
+    });
+}
+
+/**
+ * Returns a generator over the output of Render(scale), cut into
+ * tileSize x tileSize tiles (smaller along the right and bottom edges).
+ * Tiles are produced one at a time, in row-major order, each painted only
+ * from the leaves that intersect it, so the full canvas is never held.
+ *
+ * The generator refers to this tree, which must outlive it and must not be
+ * modified while tiles are being pulled.
+ *
+ * @pre scale > 0, tileSize > 0
+ */
+TileGenerator QTree::RenderTiles(unsigned int scale, unsigned int tileSize) const {
+    return TileGenerator(*this, scale, tileSize);
+}
+
+TileGenerator::TileGenerator(const QTree& tree, unsigned int scale, unsigned int tileSize)
+    : tree(tree), scale(scale), tileSize(tileSize), nextX(0), nextY(0) {
+}
+
+/**
+ * Produces the next tile in row-major order.
+ *
+ * @param tile receives the tile's position in the scaled output and its pixels
+ * @return false once every tile has been produced
+ */
+bool TileGenerator::Next(Tile& tile) {
+    uint64_t outW = uint64_t(tree.width) * scale;
+    uint64_t outH = uint64_t(tree.height) * scale;
+    if (nextY >= outH || outW == 0) {
+        return false;
+    }
+
+    tile.x = (unsigned int)nextX;
+    tile.y = (unsigned int)nextY;
+    unsigned int w = (unsigned int)min<uint64_t>(tileSize, outW - nextX);
+    unsigned int h = (unsigned int)min<uint64_t>(tileSize, outH - nextY);
+    tile.image = tree.RenderTile(scale, tile.x, tile.y, w, h);
+
+    // Advance along the row, then down to the next row of tiles
+    nextX += tileSize;
+    if (nextX >= outW) {
+        nextX = 0;
+        nextY += tileSize;
+    }
+    return true;
+}
+
+
+/**
+ * Deepest zoom level at which the image is still no larger than its
+ * original resolution, for tiles of the given size. At zoom 0 the whole
+ * image fits in a single tile; each further level doubles the resolution.
+ */
+unsigned int QTree::MaxZoom(unsigned int tileSize) const {
+    unsigned int zoom = 0;
+    while ((uint64_t(tileSize) << zoom) < max(width, height)) {
+        zoom++;
+    }
+    return zoom;
+}
+
+/**
+ * Renders tile (tx, ty) of zoom level zoom in a slippy-map style pyramid.
+ * Below MaxZoom(tileSize) each output pixel stands for a 2^k x 2^k block of
+ * source pixels, and the descent stops at the first node no larger than
+ * that block, painting its average color; only nodes intersecting the tile
+ * are visited. At MaxZoom and beyond the tile is a plain (up)scaled window,
+ * as in RenderTile.
+ *
+ * @param zoom zoom level, 0 = whole image in one tile
+ * @param tx tile column
+ * @param ty tile row
+ * @param tileSize tile width and height in pixels
+ * @pre tileSize > 0, zoom < MaxZoom(tileSize) + 32
+ * @return the tile, clipped at the right/bottom edges of the level; an
+ *         empty 0 x 0 PNG if the tile lies outside the level
+ */
+PNG QTree::RenderZoomTile(unsigned int zoom, unsigned int tx, unsigned int ty, unsigned int tileSize) const {
+    unsigned int maxZoom = MaxZoom(tileSize);
+    uint64_t x0 = uint64_t(tx) * tileSize;
+    uint64_t y0 = uint64_t(ty) * tileSize;
+
+    if (zoom >= maxZoom) {
+        unsigned int scale = 1u << (zoom - maxZoom);
+        uint64_t outW = uint64_t(width) * scale;
+        uint64_t outH = uint64_t(height) * scale;
+        if (x0 >= outW || y0 >= outH) {
+            return PNG();
+        }
+        return RenderTile(scale, (unsigned int)x0, (unsigned int)y0,
+                          (unsigned int)min<uint64_t>(tileSize, outW - x0),
+                          (unsigned int)min<uint64_t>(tileSize, outH - y0));
+    }
+
+    unsigned int shift = maxZoom - zoom;
+    uint64_t block = uint64_t(1) << shift;
+    uint64_t outW = (width + block - 1) >> shift;
+    uint64_t outH = (height + block - 1) >> shift;
+    if (x0 >= outW || y0 >= outH) {
+        return PNG();
+    }
+
+    PNG tile((unsigned int)min<uint64_t>(tileSize, outW - x0), (unsigned int)min<uint64_t>(tileSize, outH - y0));
+    RenderNodeLOD(root, shift, (unsigned int)x0, (unsigned int)y0, tile);
+    return tile;
+}
+
+// Paints the output pixels of a 2^shift-downscaled level that fall inside
+// the window at (x0, y0). Output pixel (ox, oy) samples the source pixel at
+// the centre of its block (clamped to the image), and takes the color of the
+// first node no larger than a block that contains that sample.
+void QTree::RenderNodeLOD(Node* node, unsigned int shift, unsigned int x0, unsigned int y0, PNG& tile) const {
+    int64_t block = int64_t(1) << shift;
+    int64_t half = block / 2;
+    int64_t lastCol = ((int64_t(width) + block - 1) >> shift) - 1;
+    int64_t lastRow = ((int64_t(height) + block - 1) >> shift) - 1;
+
+    // Output columns/rows whose sample lies inside a node. Only the last
+    // column/row can have its block centre past the image edge; its sample is
+    // clamped onto the edge, so it belongs to the nodes touching that edge.
+    auto sampleRange = [&](int64_t lo, int64_t hi, int64_t last, int64_t edge, int64_t& first, int64_t& end) {
+        first = lo <= half ? 0 : (lo - half + block - 1) / block;
+        end = hi < half ? -1 : (hi - half) / block;
+        if (hi == edge) {
+            end = last;
+        }
+    };
+
+    PreOrder(node, [&](Node* current) {
+        int64_t colFirst, colEnd, rowFirst, rowEnd;
+        sampleRange(current->upLeft.first, current->lowRight.first, lastCol, int64_t(width) - 1, colFirst, colEnd);
+        sampleRange(current->upLeft.second, current->lowRight.second, lastRow, int64_t(height) - 1, rowFirst, rowEnd);
+
+        // Clip to the window
+        colFirst = max<int64_t>(colFirst, x0);
+        rowFirst = max<int64_t>(rowFirst, y0);
+        colEnd = min<int64_t>(colEnd, int64_t(x0) + tile.width() - 1);
+        rowEnd = min<int64_t>(rowEnd, int64_t(y0) + tile.height() - 1);
+        if (colFirst > colEnd || rowFirst > rowEnd) {
+            return Walk::Skip; // no samples here, so none in any descendant either
+        }
+
+        bool fitsInBlock = int64_t(current->lowRight.first - current->upLeft.first) < block &&
+                           int64_t(current->lowRight.second - current->upLeft.second) < block;
+        if (!IsLeaf(current) && !fitsInBlock) {
+            return Walk::Descend;
+        }
+        RGBAPixel color = Color(current);
+        for (int64_t y = rowFirst; y <= rowEnd; y++) {
+            for (int64_t x = colFirst; x <= colEnd; x++) {
+                *tile.getPixel((unsigned int)(x - x0), (unsigned int)(y - y0)) = color;
+            }
+        }
+        return Walk::Skip;
+    });
+}
+
+/**
+ * Renders the image at full resolution and at every power-of-two downscale
+ * in a single depth-first pass. Level k is ceil(width / 2^k) x
+ * ceil(height / 2^k), and each of its pixels is the area-weighted average
+ * of the source pixels it covers.
+ *
+ * The internal averages are reused: a node's color goes into every level
+ * at which its rectangle lies within a single output pixel, and the
+ * descent for those levels stops there. Only levels where the node is
+ * still larger than a pixel continue into its children. Leaves larger
+ * than a pixel (e.g. after Prune) are spread over the pixels they overlap.
+ *
+ * @param levels number of levels to produce, including full resolution
+ * @return the levels, index 0 being full resolution
+ */
+vector<PNG> QTree::RenderPyramid(unsigned int levels) const {
+    vector<PNG> pyramid;
+    if (levels == 0) {
+        return pyramid;
+    }
+
+    // Level 0 is painted directly; the downscaled levels accumulate first
+    vector<PyramidLevel> scaled(levels);
+    pyramid.emplace_back(width, height);
+    for (unsigned int k = 1; k < levels; k++) {
+        uint64_t block = uint64_t(1) << k;
+        scaled[k].shift = k;
+        scaled[k].width = (unsigned int)((width + block - 1) >> k);
+        scaled[k].height = (unsigned int)((height + block - 1) >> k);
+        scaled[k].sums.resize(size_t(scaled[k].width) * scaled[k].height);
+    }
+
+    PyramidNode(root, levels, pyramid[0], scaled);
+
+    for (unsigned int k = 1; k < levels; k++) {
+        pyramid.emplace_back(scaled[k].width, scaled[k].height);
+        for (unsigned int y = 0; y < scaled[k].height; y++) {
+            for (unsigned int x = 0; x < scaled[k].width; x++) {
+                const ColorSum& sum = scaled[k].sums[size_t(y) * scaled[k].width + x];
+                if (sum.count > 0) {
+                    *pyramid[k].getPixel(x, y) = AverageColor(sum);
+                }
+            }
+        }
+        vector<ColorSum>().swap(scaled[k].sums);
+    }
+
+    return pyramid;
+}
+
+// Contributes node to levels [0, open) of the pyramid. Fitting in one pixel
+// is monotone in the level, so the levels still open below any node are
+// always a prefix.
+void QTree::PyramidNode(Node* node, unsigned int open, PNG& base, vector<PyramidLevel>& scaled) const {
+    // openAt[d] is the number of levels still open for the children of the
+    // node the walk last entered at depth d
+    unsigned int openAt[MaxTreeDepth];
+    NodeCursor cursor(node, NodeOrder::PreOrder);
+    for (const Node* current = cursor.Next(); current != nullptr; current = cursor.Next()) {
+        unsigned int depth = cursor.Depth();
+        unsigned int levels = depth == 0 ? open : openAt[depth - 1];
+        if (levels == 0) {
+            cursor.Skip();
+            continue;
+        }
+
+        uint64_t x0 = current->upLeft.first, y0 = current->upLeft.second;
+        uint64_t x1 = current->lowRight.first, y1 = current->lowRight.second;
+
+        // First level at which the whole rectangle lands in one output pixel
+        unsigned int fits = 0;
+        while (fits < levels && ((x0 >> fits) != (x1 >> fits) || (y0 >> fits) != (y1 >> fits))) {
+            fits++;
+        }
+        RGBAPixel color = Color(current);
+        for (unsigned int k = max(fits, 1u); k < levels; k++) {
+            scaled[k].Add(color, x0, y0, x1, y1);
+        }
+        openAt[depth] = fits;
+
+        if (IsLeaf(current)) {
+            // Nothing below to refine with: cover the remaining levels directly
+            for (uint64_t y = y0; y <= y1; y++) {
+                for (uint64_t x = x0; x <= x1; x++) {
+                    *base.getPixel((unsigned int)x, (unsigned int)y) = color;
+                }
+            }
+            for (unsigned int k = 1; k < fits; k++) {
+                scaled[k].Add(color, x0, y0, x1, y1);
+            }
+        }
+    }
+}
+
+/**
+ * Version stamp of the tree's current contents. Every constructor, copy and
+ * mutating operation assigns a new stamp, unique across all trees, so it can
+ * key caches of rendered output.
+ */
+uint64_t QTree::Version() const {
+    return version;
+}
+
+// Gives the tree a fresh, globally unique version stamp
+void QTree::Touch() {
+    static atomic<uint64_t> counter(0);
+    version = ++counter;
+}
+
+/**
+ * LRU cache of PNG-encoded zoom tiles, shared by any number of trees.
+ * @param capacity maximum number of encoded tiles kept
+ * @param tileSize tile width and height used for every request
+ */
+TileCache::TileCache(size_t capacity, unsigned int tileSize) : capacity(capacity), tileSize(tileSize) {
+}
+
+/**
+ * Returns tile (zoom, tx, ty) of tree as an encoded PNG, rendering and
+ * encoding it only if this (tree version, zoom, tx, ty) is not cached.
+ * Safe to call from several threads at once.
+ *
+ * @param png receives the encoded tile
+ * @return false if the tile lies outside the level or could not be encoded
+ */
+bool TileCache::Get(const QTree& tree, unsigned int zoom, unsigned int tx, unsigned int ty, vector<unsigned char>& png) {
+    Key key(tree.Version(), zoom, tx, ty);
+    {
+        lock_guard<mutex> lock(guard);
+        auto hit = index.find(key);
+        if (hit != index.end()) {
+            // Move to the front: most recently used
+            entries.splice(entries.begin(), entries, hit->second);
+            png = hit->second->second;
+            return true;
+        }
+    }
+
+    // Render and encode outside the lock so misses don't serialise
+    PNG tile = tree.RenderZoomTile(zoom, tx, ty, tileSize);
+    if (tile.width() == 0 || tile.height() == 0) {
+        return false;
+    }
+    vector<unsigned char> rgba(size_t(tile.width()) * tile.height() * 4);
+    for (unsigned int y = 0; y < tile.height(); y++) {
+        for (unsigned int x = 0; x < tile.width(); x++) {
+            const RGBAPixel* p = tile.getPixel(x, y);
+            unsigned char* q = &rgba[(size_t(y) * tile.width() + x) * 4];
+            q[0] = p->r;
+            q[1] = p->g;
+            q[2] = p->b;
+            q[3] = (unsigned char)(p->a * 255);
+        }
+    }
+    unsigned char* encoded = nullptr;
+    size_t encodedSize = 0;
+    unsigned int error = lodepng_encode32(&encoded, &encodedSize, rgba.data(), tile.width(), tile.height());
+    if (error != 0) {
+        free(encoded);
+        return false;
+    }
+    png.assign(encoded, encoded + encodedSize);
+    free(encoded);
+
+    lock_guard<mutex> lock(guard);
+    if (index.find(key) == index.end() && capacity > 0) {
+        entries.emplace_front(key, png);
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Renders the tree to an arbitrary outW x outH image in a single pass over
+ * the leaves, mapping each leaf rectangle straight into output coordinates
+ * (so the two axes may be scaled by different, fractional factors).
+ *
+ * ResampleMode::Nearest gives each output pixel the color of the leaf under
+ * its centre. ResampleMode::Box gives it the average of all leaves it
+ * overlaps, weighted by the overlapping area, which is the better choice
+ * when shrinking.
+ *
+ * @param outW width of the output image
+ * @param outH height of the output image
+ * @param mode how leaf edges that fall inside an output pixel are handled
+ * @pre outW > 0, outH > 0; width * outW and height * outH below 2^62
+ */
+PNG QTree::Render(unsigned int outW, unsigned int outH, ResampleMode mode) const {
+    PNG canvas(outW, outH);
+
+    if (mode == ResampleMode::Nearest) {
+        RenderNodeNearest(root, canvas);
+        return canvas;
+    }
+
+    // r, g, b and total weight for every output pixel
+    vector<double> sums(size_t(outW) * outH * 4, 0.0);
+    RenderNodeBox(root, outW, outH, sums);
+    for (unsigned int y = 0; y < outH; y++) {
+        for (unsigned int x = 0; x < outW; x++) {
+            const double* sum = &sums[(size_t(y) * outW + x) * 4];
+            if (sum[3] > 0) {
+                RGBAPixel* pixel = canvas.getPixel(x, y);
+                pixel->r = (unsigned char)(sum[0] / sum[3] + 0.5);
+                pixel->g = (unsigned char)(sum[1] / sum[3] + 0.5);
+                pixel->b = (unsigned char)(sum[2] / sum[3] + 0.5);
+            }
+        }
+    }
+    return canvas;
+}
+
+void QTree::RenderNodeNearest(Node* node, PNG& canvas) const {
+    PreOrder(node, [&](Node* current) {
+        if (!IsLeaf(current)) {
+            return Walk::Descend;
+        }
+
+        int64_t x0, x1, y0, y1;
+        CentreRange(current->upLeft.first, current->lowRight.first, width, canvas.width(), x0, x1);
+        CentreRange(current->upLeft.second, current->lowRight.second, height, canvas.height(), y0, y1);
+        RGBAPixel color = Color(current);
+        for (int64_t y = y0; y <= y1; y++) {
+            for (int64_t x = x0; x <= x1; x++) {
+                *canvas.getPixel((unsigned int)x, (unsigned int)y) = color;
+            }
+        }
+        return Walk::Skip;
+    });
+}
+
+// Adds each leaf's color to every output pixel it overlaps, weighted by the
+// overlap. Coordinates are scaled so that a source pixel is out units wide
+// and an output pixel size units wide, which keeps every edge an integer.
+void QTree::RenderNodeBox(Node* node, unsigned int outW, unsigned int outH, vector<double>& sums) const {
+    PreOrder(node, [&](Node* current) {
+        if (!IsLeaf(current)) {
+            return Walk::Descend;
+        }
+
+        uint64_t left = uint64_t(current->upLeft.first) * outW;
+        uint64_t right = uint64_t(current->lowRight.first + 1) * outW;
+        uint64_t top = uint64_t(current->upLeft.second) * outH;
+        uint64_t bottom = uint64_t(current->lowRight.second + 1) * outH;
+        RGBAPixel color = Color(current);
+
+        for (uint64_t y = top / height; y <= (bottom - 1) / height; y++) {
+            uint64_t coverY = min(bottom, (y + 1) * height) - max(top, y * height);
+            for (uint64_t x = left / width; x <= (right - 1) / width; x++) {
+                uint64_t coverX = min(right, (x + 1) * width) - max(left, x * width);
+                double weight = double(coverX) * double(coverY);
+                double* sum = &sums[(size_t(y) * outW + x) * 4];
+                sum[0] += color.r * weight;
+                sum[1] += color.g * weight;
+                sum[2] += color.b * weight;
+                sum[3] += weight;
+            }
+        }
+        return Walk::Skip;
+    });
+}
+
+
+/**
+ * Like Render(scale), but instead of flat blocks the output interpolates
+ * bilinearly between the centres of neighbouring leaves. Every output pixel
+ * is sampled at its centre, mapped back to source coordinates. Along its
+ * source row, the sample is blended between the centre of the leaf holding
+ * it and the centre of the next leaf on the sample's side. The same blend
+ * is taken along the row just past the leaf's top or bottom edge (whichever
+ * side the sample is on), and the two are mixed by the sample's position
+ * between the two leaves' centre rows. Past the outermost leaf centres the
+ * color is held flat, so an unpruned tree renders exactly as Render(1) at
+ * scale 1.
+ *
+ * The image is produced one source row at a time. The row's leaves are
+ * gathered once and blended along the output row into per-column buffers,
+ * each leaf span being a straight loop that the compiler vectorizes; the
+ * scale output rows are then vertical blends of those buffers. Working
+ * memory is a few output rows, not a full-resolution raster.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0
+ */
+PNG QTree::RenderSmooth(unsigned int scale) const {
+    unsigned int outW = width * scale;
+    unsigned int outH = height * scale;
+    PNG canvas(outW, outH);
+    if (root == nullptr) {
+        return canvas;
+    }
+
+    // Collects the leaves of source row y across columns [x0, x1]
+    vector<const Node*> nodes;
+    auto gather = [&](unsigned int y, unsigned int x0, unsigned int x1, vector<RowLeaf>& row) {
+        nodes.clear();
+        RowLeaves(y, x0, x1, nodes);
+        row.clear();
+        for (const Node* node : nodes) {
+            RGBAPixel color = Color(node);
+            row.push_back({node->upLeft.first, node->lowRight.first, node->upLeft.second, node->lowRight.second,
+                           (double(node->upLeft.first) + node->lowRight.first + 1) / 2,
+                           (double(node->upLeft.second) + node->lowRight.second + 1) / 2,
+                           {float(color.r), float(color.g), float(color.b)}});
+        }
+    };
+
+    // Per output column: the blend along the current source row and along
+    // the rows just above and below the leaf holding the column, with the
+    // centre row of the leaf each blend was taken in
+    size_t stride = outW;
+    vector<float> here(3 * stride), above(3 * stride), below(3 * stride);
+    vector<double> hereY(stride), aboveY(stride), belowY(stride);
+
+    // Blends along source row y over source columns [left, right], or, if
+    // that row is outside the image, repeats the current row so the sample
+    // stays flat
+    vector<RowLeaf> row, probe;
+    auto blendNext = [&](unsigned int left, unsigned int right, bool inside, unsigned int y,
+                         float* color, double* centreY) {
+        uint64_t first = uint64_t(left) * scale;
+        uint64_t last = (uint64_t(right) + 1) * scale - 1;
+        if (!inside) {
+            for (int c = 0; c < 3; c++) {
+                copy(&here[c * stride + first], &here[c * stride + last] + 1, color + c * stride + first);
+            }
+            copy(&hereY[first], &hereY[last] + 1, centreY + first);
+            return;
+        }
+
+        // Leaves of row y across those columns, widened by one leaf on each
+        // side so every one of them has its neighbours
+        gather(y, left, right, probe);
+        unsigned int x0 = probe.front().left;
+        unsigned int x1 = probe.back().right;
+        gather(y, x0 > 0 ? x0 - 1 : x0, x1 + 1 < width ? x1 + 1 : x1, probe);
+        BlendRow(probe, first, last, scale, color, stride, centreY);
+    };
+
+    for (unsigned int y = 0; y < height; y++) {
+        gather(y, 0, width - 1, row);
+        BlendRow(row, 0, outW - 1, scale, here.data(), stride, hereY.data());
+        // The rows just past each leaf's top and bottom edges; neighbouring
+        // leaves that share an edge row are blended in one pass
+        for (size_t j = 0; j < row.size();) {
+            size_t k = j + 1;
+            while (k < row.size() && row[k].top == row[j].top) {
+                k++;
+            }
+            blendNext(row[j].left, row[k - 1].right, row[j].top > 0, row[j].top - 1, above.data(), aboveY.data());
+            j = k;
+        }
+        for (size_t j = 0; j < row.size();) {
+            size_t k = j + 1;
+            while (k < row.size() && row[k].bottom == row[j].bottom) {
+                k++;
+            }
+            blendNext(row[j].left, row[k - 1].right, row[j].bottom + 1 < height, row[j].bottom + 1,
+                      below.data(), belowY.data());
+            j = k;
+        }
+
+        for (unsigned int k = 0; k < scale; k++) {
+            unsigned int outY = y * scale + k;
+            double sampleY = (outY + 0.5) / scale;
+            for (size_t x = 0; x < stride; x++) {
+                // Mix toward the row blend past the leaf's edge on the
+                // sample's side, by the sample's place between the centres
+                bool down = sampleY >= hereY[x];
+                const float* next = down ? &below[x] : &above[x];
+                double nextY = down ? belowY[x] : aboveY[x];
+                float t = nextY == hereY[x] ? 0.0f : float((sampleY - hereY[x]) / (nextY - hereY[x]));
+                RGBAPixel* pixel = canvas.getPixel(x, outY);
+                pixel->r = (unsigned char)(here[x] + t * (next[0] - here[x]) + 0.5f);
+                pixel->g = (unsigned char)(here[stride + x] + t * (next[stride] - here[stride + x]) + 0.5f);
+                pixel->b = (unsigned char)(here[2 * stride + x] + t * (next[2 * stride] - here[2 * stride + x]) + 0.5f);
+            }
+        }
+    }
+    return canvas;
+}
+
+// Appends the leaves crossing source row y whose columns meet [x0, x1],
+// left to right
+void QTree::RowLeaves(unsigned int y, unsigned int x0, unsigned int x1, vector<const Node*>& leaves) const {
+    PreOrder(root, [&](Node* node) {
+        if (y < node->upLeft.second || y > node->lowRight.second ||
+            x1 < node->upLeft.first || x0 > node->lowRight.first) {
+            return Walk::Skip;
+        }
+        if (IsLeaf(node)) {
+            leaves.push_back(node);
+            return Walk::Skip;
+        }
+        return Walk::Descend;
+    });
+}
+
+
+/**
+ * Exports the rendered image as a compact list of axis-aligned rectangles.
+ * Neighboring leaves with the same color (common after Prune) are merged
+ * in two passes. First, leaves that span the same rows and touch side by
+ * side are joined into runs as long as possible. Then runs that span the
+ * same columns and touch top to bottom are stacked as tall as possible.
+ *
+ * The result is maximal in that sense: no two rectangles of one color
+ * share their columns and touch vertically, and no two share their rows
+ * and touch horizontally unless stacking made their rows match. It is not
+ * a minimum cover; a region such as an L shape stays split along the
+ * leaves' edges. Each pass is a sort and a sweep (the second with an
+ * ordered map from columns to the rectangle open above them), so the cost
+ * is O(n log n) for n leaves.
+ *
+ * The rectangles are disjoint and together cover the image exactly.
+ *
+ * @param order RectOrder::Scanline sorts by top edge then left edge;
+ *              RectOrder::Morton sorts by Z-order of the upper-left corner
+ */
+vector<ColorRect> QTree::MergedRects(RectOrder order) const {
+    vector<ColorRect> rects;
+    CollectLeaves(root, rects);
+
+    JoinRuns(rects);
+    StackRuns(rects);
+
+    if (order == RectOrder::Morton) {
+        sort(rects.begin(), rects.end(), [](const ColorRect& a, const ColorRect& b) {
+            return MortonCode(a.upLeft.first, a.upLeft.second) < MortonCode(b.upLeft.first, b.upLeft.second);
+        });
+    } else {
+        sort(rects.begin(), rects.end(), [](const ColorRect& a, const ColorRect& b) {
+            return make_pair(a.upLeft.second, a.upLeft.first) < make_pair(b.upLeft.second, b.upLeft.first);
+        });
+    }
+    return rects;
+}
+
+// Appends the rectangle and color of every leaf under node
+void QTree::CollectLeaves(Node* node, vector<ColorRect>& leaves) const {
+    PreOrder(node, [&](Node* current) {
+        if (!IsLeaf(current)) {
+            return Walk::Descend;
+        }
+        leaves.push_back({current->upLeft, current->lowRight, Color(current)});
+        return Walk::Skip;
+    });
+}
+
+/**
+ * Range over the tree's leaves in the order Render paints them (NW, NE,
+ * SW, SE), for use with range-for and standard algorithms. Each element is
+ * a NodeView with the leaf's rectangle, displayed color and depth (the
+ * root is at depth 0). Iterating allocates nothing.
+ *
+ * The range refers to this tree, which must outlive it and must not be
+ * modified while it is being iterated.
+ */
+NodeRange QTree::Leaves() const {
+    return NodeRange(root, NodeOrder::PreOrder, true, transformPending ? &colorTransform : nullptr);
+}
+
+/**
+ * Range over every node of the tree, leaves and internal nodes alike, as
+ * NodeViews. PreOrder yields each node before its children and PostOrder
+ * after them, children in NW, NE, SW, SE order; LevelOrder yields all
+ * nodes at depth 0, then depth 1, and so on, left to right within a level.
+ * Iterating allocates nothing; LevelOrder re-walks the levels above the
+ * one it is yielding, which for a quadtree adds about a third.
+ *
+ * Same lifetime rules as Leaves.
+ *
+ * @param order traversal order
+ */
+NodeRange QTree::Nodes(NodeOrder order) const {
+    return NodeRange(root, order, false, transformPending ? &colorTransform : nullptr);
+}
+
+NodeRange::NodeRange(const Node* root, NodeOrder order, bool leavesOnly, const ColorTransform* transform)
+    : root(root), order(order), leavesOnly(leavesOnly), transform(transform) {
+}
+
+NodeIterator NodeRange::begin() const {
+    return NodeIterator(root, order, leavesOnly, transform);
+}
+
+NodeIterator NodeRange::end() const {
+    return NodeIterator();
+}
+
+NodeIterator::NodeIterator() : leavesOnly(false), transform(nullptr), current(nullptr) {
+}
+
+NodeIterator::NodeIterator(const Node* root, NodeOrder order, bool leavesOnly, const ColorTransform* transform)
+    : cursor(root, order), leavesOnly(leavesOnly), transform(transform), current(nullptr) {
+    Advance();
+}
+
+NodeView NodeIterator::operator*() const {
+    NodeView view;
+    view.upLeft = current->upLeft;
+    view.lowRight = current->lowRight;
+    view.avg = transform != nullptr ? transform->Apply(current->avg) : current->avg;
+    view.depth = cursor.Depth();
+    view.leaf = !HasChildren(current);
+    return view;
+}
+
+NodeIterator::Arrow NodeIterator::operator->() const {
+    return Arrow{**this};
+}
+
+NodeIterator& NodeIterator::operator++() {
+    Advance();
+    return *this;
+}
+
+NodeIterator NodeIterator::operator++(int) {
+    NodeIterator before(*this);
+    Advance();
+    return before;
+}
+
+bool NodeIterator::operator==(const NodeIterator& other) const {
+    return current == other.current;
+}
+
+bool NodeIterator::operator!=(const NodeIterator& other) const {
+    return current != other.current;
+}
+
+// Moves the cursor on to the next node that passes the filter, or to the end
+void NodeIterator::Advance() {
+    do {
+        current = cursor.Next();
+    } while (current != nullptr && leavesOnly && HasChildren(current));
+}
+
+
+/**
+ * Renders the tree as run-length encoded scanlines instead of pixels. For
+ * every row of the Render(scale) output, returns its runs left to right;
+ * adjacent leaves of the same color share one run. A row's runs come
+ * straight from the leaves crossing the corresponding source row, found by
+ * descending only into nodes that span it, so large flat regions cost one
+ * run rather than one write per pixel.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0
+ * @return height * scale rows of runs; each row's runs cover [0, width * scale)
+ */
+vector<vector<ColorRun>> QTree::RenderRuns(unsigned int scale) const {
+    vector<vector<ColorRun>> rows;
+    rows.reserve(size_t(height) * scale);
+
+    vector<ColorRun> runs;
+    for (unsigned int y = 0; y < height; y++) {
+        runs.clear();
+        RowRuns(root, y, scale, runs);
+        sort(runs.begin(), runs.end(), [](const ColorRun& a, const ColorRun& b) { return a.x < b.x; });
+
+        // Join neighbors of the same color
+        size_t kept = 0;
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (kept > 0 && runs[kept - 1].color == runs[i].color) {
+                runs[kept - 1].length += runs[i].length;
+            } else {
+                runs[kept++] = runs[i];
+            }
+        }
+        runs.resize(kept);
+
+        // Every output row of this source row is identical
+        for (unsigned int i = 0; i < scale; i++) {
+            rows.push_back(runs);
+        }
+    }
+    return rows;
+}
+
+// Appends one run per leaf under node that crosses source row y
+void QTree::RowRuns(Node* node, unsigned int y, unsigned int scale, vector<ColorRun>& runs) const {
+    PreOrder(node, [&](Node* current) {
+        if (y < current->upLeft.second || y > current->lowRight.second) {
+            return Walk::Skip;
+        }
+        if (!IsLeaf(current)) {
+            return Walk::Descend;
+        }
+        runs.push_back({current->upLeft.first * scale, (current->lowRight.first - current->upLeft.first + 1) * scale,
+                        Color(current)});
+        return Walk::Skip;
+    });
+}
+
+
+/**
+ * Measures how far the tree's rendering is from source, without rendering.
+ * Each leaf's rectangle of source pixels is compared with the leaf's color:
+ *
+ *  - mse/psnr are over the r, g and b channels of every pixel;
+ *  - ssim is a block SSIM that uses the leaves as the blocks. A leaf renders
+ *    as a flat block, so its structure and contrast terms reduce to
+ *    C2 / (source variance + C2); the per-leaf scores (averaged over the
+ *    three channels) are weighted by leaf area.
+ *
+ * Per leaf only the sums of source values and of their squares are needed,
+ * gathered with one contiguous sweep per row of the rectangle.
+ *
+ * @param source the image the tree was built from
+ * @return the error statistics; psnr is +infinity for an exact match. All
+ *         three are NaN if source is not width x height (e.g. after
+ *         RotateCCW), as the leaves would then fall outside it.
+ */
+ErrorStats QTree::ErrorAgainst(const PNG& source) const {
+    if (source.width() != width || source.height() != height) {
+        double nan = numeric_limits<double>::quiet_NaN();
+        return ErrorStats{nan, nan, nan};
+    }
+
+    ErrorStats stats = {0.0, numeric_limits<double>::infinity(), 1.0};
+    uint64_t pixels = uint64_t(width) * height;
+    if (root == nullptr || pixels == 0) {
+        return stats;
+    }
+
+    double squaredError = 0.0;
+    double ssimSum = 0.0;
+    ErrorNode(root, source, squaredError, ssimSum);
+
+    stats.mse = squaredError / (3.0 * pixels);
+    if (stats.mse > 0) {
+        stats.psnr = 10.0 * log10(255.0 * 255.0 / stats.mse);
+    }
+    stats.ssim = ssimSum / pixels;
+    return stats;
+}
+
+// Adds every leaf's squared error and area-weighted SSIM under node
+void QTree::ErrorNode(Node* node, const PNG& source, double& squaredError, double& ssimSum) const {
+    PreOrder(node, [&](Node* current) {
+        if (!IsLeaf(current)) {
+            return Walk::Descend;
+        }
+
+        // Per-channel sums of source values and squared values over the leaf
+        uint64_t sum[3] = {0, 0, 0};
+        uint64_t sumSq[3] = {0, 0, 0};
+        unsigned int x0 = current->upLeft.first;
+        unsigned int span = current->lowRight.first - x0 + 1;
+        for (unsigned int y = current->upLeft.second; y <= current->lowRight.second; y++) {
+            // PNG stores each row contiguously, so the leaf's span is one array
+            const RGBAPixel* row = source.getPixel(x0, y);
+            for (unsigned int i = 0; i < span; i++) {
+                sum[0] += row[i].r;
+                sum[1] += row[i].g;
+                sum[2] += row[i].b;
+                sumSq[0] += row[i].r * row[i].r;
+                sumSq[1] += row[i].g * row[i].g;
+                sumSq[2] += row[i].b * row[i].b;
+            }
+        }
+
+        const double C1 = (0.01 * 255) * (0.01 * 255);
+        const double C2 = (0.03 * 255) * (0.03 * 255);
+        double n = double(RectArea(current->upLeft, current->lowRight));
+        RGBAPixel color = Color(current);
+        const double leafColor[3] = {double(color.r), double(color.g), double(color.b)};
+
+        double ssim = 0.0;
+        for (int c = 0; c < 3; c++) {
+            double a = leafColor[c];
+            // sum of (s - a)^2 = sum s^2 - 2 a sum s + n a^2
+            squaredError += double(sumSq[c]) - 2.0 * a * double(sum[c]) + n * a * a;
+
+            double mean = double(sum[c]) / n;
+            double variance = max(0.0, double(sumSq[c]) / n - mean * mean);
+            ssim += ((2 * mean * a + C1) * C2) / ((mean * mean + a * a + C1) * (variance + C2));
+        }
+        ssimSum += n * ssim / 3.0;
+        return Walk::Skip;
+    });
+}
+
+
+/**
+ * Area-weighted RGB histogram of the rendered image, computed from the
+ * tree in O(nodes visited) instead of O(pixels). Each channel is divided
+ * into bins equal ranges, giving bins^3 cells indexed
+ * (rBin * bins + gBin) * bins + bBin; each cell holds a pixel count.
+ *
+ * With maxDepth, the descent stops at that depth and counts each node's
+ * average color over its whole rectangle: a coarser but much cheaper
+ * histogram (depth 0 is the root alone).
+ *
+ * @param bins number of bins per channel, 1..256
+ * @param maxDepth deepest level whose nodes are visited
+ */
+vector<uint64_t> QTree::Histogram(unsigned int bins, unsigned int maxDepth) const {
+    vector<uint64_t> counts(size_t(bins) * bins * bins, 0);
+    HistogramCells(maxDepth, bins, 1, counts);
+    return counts;
+}
+
+/**
+ * The k most common colors of the rendered image. Colors are grouped into
+ * a 16 x 16 x 16 area-weighted histogram (see Histogram), and each of the
+ * k heaviest cells is reported as the mean color of the area that fell
+ * into it, most common first.
+ *
+ * @param k number of colors wanted; fewer are returned if the image has
+ *          fewer distinct cells
+ * @param maxDepth as in Histogram
+ */
+vector<RGBAPixel> QTree::DominantColors(unsigned int k, unsigned int maxDepth) const {
+    const unsigned int bins = 16;
+    vector<uint64_t> cells(size_t(bins) * bins * bins * 4, 0);
+    HistogramCells(maxDepth, bins, 4, cells);
+
+    vector<size_t> order;
+    for (size_t i = 0; 4 * i < cells.size(); i++) {
+        if (cells[4 * i + 3] > 0) {
+            order.push_back(i);
+        }
+    }
+    size_t wanted = min<size_t>(k, order.size());
+    partial_sort(order.begin(), order.begin() + wanted, order.end(), [&cells](size_t a, size_t b) {
+        return cells[4 * a + 3] > cells[4 * b + 3];
+    });
+
+    vector<RGBAPixel> colors;
+    for (size_t i = 0; i < wanted; i++) {
+        ColorSum sum;
+        sum.r = cells[4 * order[i]];
+        sum.g = cells[4 * order[i] + 1];
+        sum.b = cells[4 * order[i] + 2];
+        sum.count = cells[4 * order[i] + 3];
+        colors.push_back(AverageColor(sum));
+    }
+    return colors;
+}
+
+// Adds the area-weighted histogram to cells, which holds fields entries per
+// cell: with 1 just the area, with 4 the area-weighted r, g and b sums and
+// then the area. Counts every leaf no deeper than maxDepth and every node
+// exactly at maxDepth, which is where a depth-limited descent stops. Reads
+// the histogram cache while it is on, and otherwise walks the nodes.
+void QTree::HistogramCells(unsigned int maxDepth, unsigned int bins, unsigned int fields,
+                           vector<uint64_t>& cells) const {
+    if (!histogramCacheOn) {
+        HistogramNode(root, maxDepth, bins, fields, cells);
+        return;
+    }
+
+    // Levels below maxDepth are a suffix of the cache and are never read;
+    // nodes from cut on sit exactly at maxDepth and count even if not leaves
+    shared_ptr<const HistogramCache> planes = HistogramPlanes();
+    size_t levels = planes->levelEnd.size();
+    size_t end = maxDepth < levels ? planes->levelEnd[maxDepth] : planes->r.size();
+    size_t cut = maxDepth == 0 ? 0 : maxDepth < levels ? planes->levelEnd[maxDepth - 1] : end;
+    for (size_t i = 0; i < end; i++) {
+        if (planes->leaf[i] || i >= cut) {
+            AddToHistogram(cells, bins, fields, planes->r[i], planes->g[i], planes->b[i], planes->area[i]);
+        }
+    }
+}
+
+// HistogramCells over the nodes, descending no deeper than maxDepth
+void QTree::HistogramNode(Node* node, unsigned int maxDepth, unsigned int bins, unsigned int fields,
+                          vector<uint64_t>& cells) const {
+    NodeCursor cursor(node, NodeOrder::PreOrder);
+    for (const Node* current = cursor.Next(); current != nullptr; current = cursor.Next()) {
+        if (IsLeaf(current) || cursor.Depth() >= maxDepth) {
+            RGBAPixel color = Color(current);
+            AddToHistogram(cells, bins, fields, color.r, color.g, color.b, RectArea(current->upLeft, current->lowRight));
+            cursor.Skip();
+        }
+    }
+}
+
+/**
+ * Turns the histogram cache on or off. While it is on, Histogram and
+ * DominantColors read a cached copy of each node's displayed color, area
+ * and leaf flag (12 bytes per node, one array per field) in one linear
+ * scan instead of chasing node pointers. The cache is rebuilt on the first
+ * such call after any change, so it only pays off for repeated queries on
+ * an unchanging tree. While it is off (the default) the nodes are walked
+ * directly, and turning it off frees the cache.
+ *
+ * @param enable true to keep and use the histogram cache
+ */
+void QTree::UseHistogramCache(bool enable) {
+    histogramCacheOn = enable;
+    if (!enable) {
+        lock_guard<mutex> lock(histogramCacheLock);
+        histogramCache.reset();
+    }
+}
+
+// Returns the histogram cache, rebuilding it if the tree changed since it
+// was last built
+shared_ptr<const QTree::HistogramCache> QTree::HistogramPlanes() const {
+    lock_guard<mutex> lock(histogramCacheLock);
+    if (histogramCache == nullptr || histogramCache->version != version) {
+        shared_ptr<HistogramCache> fresh = make_shared<HistogramCache>();
+        fresh->version = version;
+        GatherHistogramPlanes(*fresh);
+        // The cache holds displayed colors; the nodes keep theirs
+        if (transformPending) {
+            TransformPlanes(colorTransform, fresh->r.data(), fresh->g.data(), fresh->b.data(), fresh->r.size());
+        }
+        histogramCache = fresh;
+    }
+    return histogramCache;
+}
+
+// Fills planes with the tree's nodes, one level at a time
+void QTree::GatherHistogramPlanes(HistogramCache& planes) const {
+    vector<Node*> level;
+    vector<Node*> below;
+    if (root != nullptr) {
+        level.push_back(root);
+    }
+
+    while (!level.empty()) {
+        below.clear();
+        for (Node* node : level) {
+            planes.r.push_back(node->avg.r);
+            planes.g.push_back(node->avg.g);
+            planes.b.push_back(node->avg.b);
+            planes.area.push_back(RectArea(node->upLeft, node->lowRight));
+            planes.leaf.push_back(IsLeaf(node));
+
+            Node* children[4] = {node->NW, node->NE, node->SW, node->SE};
+            for (Node* child : children) {
+                if (child != nullptr) {
+                    below.push_back(child);
+                }
+            }
+        }
+        planes.levelEnd.push_back(planes.r.size());
+        level.swap(below);
+    }
+}
+
+
+/**
+ * Reduces the tree to a palette of at most k colors, in place, so that
+ * Render (and every other output) produces palettised images ready for
+ * GIF/PNG8 export.
+ *
+ * Clustering works on the distinct leaf colors weighted by leaf area, not
+ * on pixels: it is seeded with DominantColors(k), refined with weighted
+ * k-means until assignments settle (at most 16 rounds), and then every
+ * node's average is replaced by its nearest palette color. Alpha is kept.
+ *
+ * @param k maximum palette size
+ * @return the palette
+ */
+vector<RGBAPixel> QTree::QuantizeColors(unsigned int k) {
+    MaterializeColorTransform();
+
+    vector<ColorRect> leaves;
+    CollectLeaves(root, leaves);
+
+    // Distinct leaf colors with their total area
+    vector<pair<uint32_t, uint64_t>> colors;
+    for (const ColorRect& leaf : leaves) {
+        colors.push_back({PackRGB(leaf.color), RectArea(leaf.upLeft, leaf.lowRight)});
+    }
+    sort(colors.begin(), colors.end());
+    size_t kept = 0;
+    for (size_t i = 0; i < colors.size(); i++) {
+        if (kept > 0 && colors[kept - 1].first == colors[i].first) {
+            colors[kept - 1].second += colors[i].second;
+        } else {
+            colors[kept++] = colors[i];
+        }
+    }
+    colors.resize(kept);
+
+    vector<RGBAPixel> palette = DominantColors(k);
+    vector<size_t> assigned(colors.size(), SIZE_MAX);
+    for (int round = 0; round < 16 && !palette.empty(); round++) {
+        bool changed = false;
+        vector<ColorSum> sums(palette.size());
+        for (size_t i = 0; i < colors.size(); i++) {
+            RGBAPixel color((colors[i].first >> 16) & 0xFF, (colors[i].first >> 8) & 0xFF, colors[i].first & 0xFF);
+            size_t nearest = NearestColor(palette, color);
+            changed = changed || nearest != assigned[i];
+            assigned[i] = nearest;
+            AddColor(sums[nearest], color, colors[i].second);
+        }
+        if (!changed) {
+            break;
+        }
+        for (size_t c = 0; c < palette.size(); c++) {
+            if (sums[c].count > 0) {
+                palette[c] = AverageColor(sums[c]);
+            }
+        }
+    }
+
+    if (!palette.empty()) {
+        unordered_map<uint32_t, size_t> nearest;
+        QuantizeNode(root, palette, nearest);
+    }
+    Touch();
+    return palette;
+}
+
+// Replaces the color of node and its descendants by the nearest palette
+// entry; nearest memoises the lookup per distinct color
+void QTree::QuantizeNode(Node* node, const vector<RGBAPixel>& palette, unordered_map<uint32_t, size_t>& nearest) {
+    PreOrder(node, [&](Node* current) {
+        uint32_t key = PackRGB(current->avg);
+        auto found = nearest.find(key);
+        if (found == nearest.end()) {
+            found = nearest.emplace(key, NearestColor(palette, current->avg)).first;
+        }
+        const RGBAPixel& target = palette[found->second];
+        current->avg.r = target.r;
+        current->avg.g = target.g;
+        current->avg.b = target.b;
+        return Walk::Descend;
+    });
+}
+
+
+/**
+ * The identity transform: no mixing, every lookup maps a value to itself.
+ */
+ColorTransform ColorTransform::Identity() {
+    ColorTransform t;
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < 4; i++) {
+            t.matrix[c][i] = (c == i) ? 1.0f : 0.0f;
+        }
+        for (int v = 0; v < 256; v++) {
+            t.lut[c][v] = (unsigned char)v;
+        }
+    }
+    t.mixes = false;
+    t.maps = false;
+    return t;
+}
+
+/**
+ * Adds delta to every channel (clamped).
+ */
+ColorTransform ColorTransform::Brightness(int delta) {
+    ColorTransform t = Identity();
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            t.lut[c][v] = ClampChannel(v + delta);
+        }
+    }
+    t.maps = true;
+    return t;
+}
+
+/**
+ * Scales every channel's distance from mid-grey (128) by factor.
+ */
+ColorTransform ColorTransform::Contrast(double factor) {
+    ColorTransform t = Identity();
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            t.lut[c][v] = ClampChannel(128 + (v - 128) * factor);
+        }
+    }
+    t.maps = true;
+    return t;
+}
+
+/**
+ * Applies out = 255 * (in / 255)^(1 / gamma) to every channel.
+ * @pre gamma > 0
+ */
+ColorTransform ColorTransform::Gamma(double gamma) {
+    ColorTransform t = Identity();
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            t.lut[c][v] = ClampChannel(255.0 * pow(v / 255.0, 1.0 / gamma));
+        }
+    }
+    t.maps = true;
+    return t;
+}
 
-    // The entire image is represented by the root node
-    // Upper-left corner is (0, 0)
-    // Lower-right corner is (width - 1, height - 1)
-    root = BuildNode(imIn, make_pair(0, 0), make_pair(width - 1, height - 1));
+/**
+ * Mixes channels: (r, g, b) becomes m * (r, g, b, 1), clamped.
+ * Row c of m produces output channel c; column 3 is a constant offset.
+ */
+ColorTransform ColorTransform::Mix(const float m[3][4]) {
+    ColorTransform t = Identity();
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < 4; i++) {
+            t.matrix[c][i] = m[c][i];
+        }
+    }
+    t.mixes = true;
+    return t;
 }
 
+/**
+ * Maps each channel through its own 256-entry table.
+ */
+ColorTransform ColorTransform::Lookup(const unsigned char table[3][256]) {
+    ColorTransform t = Identity();
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            t.lut[c][v] = table[c][v];
+        }
+    }
+    t.maps = true;
+    return t;
+}
 
 /**
- * Overloaded assignment operator for QTrees.
- * Part of the Big Three that we must define because the class
- * allocates dynamic memory. This depends on your implementation
- * of the copy and clear funtions.
+ * Applies the transform to one color: the channel mix first, then the
+ * per-channel lookup. Alpha is unchanged.
+ */
+RGBAPixel ColorTransform::Apply(const RGBAPixel& p) const {
+    RGBAPixel out = p;
+    if (mixes) {
+        double in[4] = {double(p.r), double(p.g), double(p.b), 1.0};
+        unsigned char mixed[3];
+        for (int c = 0; c < 3; c++) {
+            mixed[c] = ClampChannel(matrix[c][0] * in[0] + matrix[c][1] * in[1] + matrix[c][2] * in[2] +
+                                    matrix[c][3] * in[3]);
+        }
+        out.r = mixed[0];
+        out.g = mixed[1];
+        out.b = mixed[2];
+    }
+    out.r = lut[0][out.r];
+    out.g = lut[1][out.g];
+    out.b = lut[2][out.b];
+    return out;
+}
+
+/**
+ * Records a color transform to be applied on top of the current colors.
+ * Nothing is rewritten: the transform is kept as one pending mix + lookup
+ * per tree, and Render and the other outputs apply it as they read each
+ * node's color. A new lookup composes with the pending one exactly, in
+ * O(1). A new mix is folded into a pending mix-only transform as one
+ * matrix only when that gives the same colors: the pending mix must send
+ * every color to whole in-range values, since applying it clamps and
+ * rounds. Any other mix forces the pending transform into the nodes first
+ * (O(nodes)).
  *
- * @param rhs The right hand side of the assignment statement.
+ * Prune and QuantizeColors materialize the pending transform before they
+ * run, since they compare the displayed colors.
  */
-QTree& QTree::operator=(const QTree& rhs) {
-    // Step 1: Self-assignment check
-    if (this == &rhs) {
-        return *this;
+void QTree::ApplyColorTransform(const ColorTransform& transform) {
+    float product[3][4];
+    if (!transformPending) {
+        colorTransform = transform;
+    } else if (!transform.mixes) {
+        // Lookup after lookup: compose the tables
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                colorTransform.lut[c][v] = transform.lut[c][colorTransform.lut[c][v]];
+            }
+        }
+        colorTransform.maps = colorTransform.maps || transform.maps;
+    } else if (!colorTransform.maps && ComposeMixes(transform.matrix, colorTransform.matrix, product)) {
+        // Mix after mix: one matrix (new * pending) gives the same colors
+        colorTransform = transform;
+        for (int c = 0; c < 3; c++) {
+            for (int i = 0; i < 4; i++) {
+                colorTransform.matrix[c][i] = product[c][i];
+            }
+        }
+    } else {
+        MaterializeColorTransform();
+        colorTransform = transform;
     }
 
-    // Step 2: Clear current contents
-    Clear();
+    transformPending = colorTransform.mixes || colorTransform.maps;
+    Touch();
+}
 
-    // Step 3: Copy contents from rhs
-    Copy(rhs);
+/**
+ * Bakes the pending color transform into every node's average, in one
+ * O(nodes) pass, and clears it. Later reads then cost nothing extra.
+ */
+void QTree::MaterializeColorTransform() {
+    if (!transformPending) {
+        return;
+    }
+    MaterializeNode(root);
+    colorTransform = ColorTransform::Identity();
+    transformPending = false;
+}
 
-    // Step 4: Return *this
-    return *this;
+void QTree::MaterializeNode(Node* node) {
+    PreOrder(node, [this](Node* current) {
+        current->avg = colorTransform.Apply(current->avg);
+        return Walk::Descend;
+    });
+}
+
+// Color of node as displayed, i.e. with any pending transform applied
+RGBAPixel QTree::Color(const Node* node) const {
+    return transformPending ? colorTransform.Apply(node->avg) : node->avg;
 }
 
+
 /**
- * Render returns a PNG image consisting of the pixels
- * stored in the tree. may be used on pruned trees. Draws
- * every leaf node's rectangle onto a PNG canvas using the
- * average color stored in the node.
- *
- * For up-scaled images, no color interpolation will be done;
- * each rectangle is fully rendered into a larger rectangular region.
+ * Renders the tree at the given scale and writes it to a PNG file.
+ * Leaves are painted directly into the packed RGBA8 buffer handed to the
+ * encoder, so no PNG object is materialised in between (Render followed by
+ * PNG::writeToFile holds both the RGBAPixel canvas and its byte copy).
  *
+ * @param pngFile path of the PNG file to write
  * @param scale multiplier for each horizontal/vertical dimension
  * @pre scale > 0
+ * @return true if the file was written successfully
  */
-PNG QTree::Render(unsigned int scale) const {
-    // Create a scaled PNG canvas
-    PNG canvas(width * scale, height * scale);
+bool QTree::WriteRender(const string& pngFile, unsigned int scale) const {
+    unsigned int outW = width * scale;
+    unsigned int outH = height * scale;
 
-    // Start rendering from the root
-    RenderNode(root, scale, canvas);
+    vector<unsigned char> bytes(size_t(outW) * outH * 4);
+    RenderNodeRGBA8(root, scale, bytes.data(), size_t(outW) * 4);
 
-    return canvas;
+    unsigned int error = lodepng_encode32_file(pngFile.c_str(), bytes.data(), outW, outH);
+    if (error != 0) {
+        cerr << "[QTree]: PNG encoding error " << error << " writing " << pngFile << endl;
+        return false;
+    }
+    return true;
 }
 
+// Same traversal as RenderNode, but paints into a packed RGBA8 buffer one
+// output row span at a time
+void QTree::RenderNodeRGBA8(Node* node, unsigned int scale, unsigned char* out, size_t stride) const {
+    PreOrder(node, [&](Node* current) {
+        if (!IsLeaf(current)) {
+            return Walk::Descend;
+        }
 
-void QTree::RenderNode(Node* node, unsigned int scale, PNG& canvas) const {
-    if (node == nullptr) {
-        // Base case: if the node is null, there's nothing to render.
-        return;
+        RGBAPixel color = Color(current);
+        unsigned char rgba[4] = {color.r, color.g, color.b, (unsigned char)(color.a * 255)};
+        size_t x0 = size_t(current->upLeft.first) * scale;
+        size_t x1 = size_t(current->lowRight.first + 1) * scale;
+        size_t y0 = size_t(current->upLeft.second) * scale;
+        size_t y1 = size_t(current->lowRight.second + 1) * scale;
+
+        for (size_t y = y0; y < y1; y++) {
+            unsigned char* p = out + y * stride + x0 * 4;
+            for (size_t x = x0; x < x1; x++, p += 4) {
+                p[0] = rgba[0];
+                p[1] = rgba[1];
+                p[2] = rgba[2];
+                p[3] = rgba[3];
+            }
+        }
+        return Walk::Skip;
+    });
+}
+
+
+/**
+ * Runs every job in jobs through decode -> construct -> Prune -> flip/rotate
+ * -> Render -> encode on a bounded pool of worker threads.
+ *
+ * Each worker claims the next unstarted job and carries it through all
+ * stages, so at any moment different images are being read, built, pruned
+ * and encoded in parallel. A worker only claims a new job once its current
+ * one is written, which is the back-pressure: at most options.threads
+ * images (decoded buffer, tree and output raster) are alive at once,
+ * however long the job list is.
+ *
+ * @param jobs input/output file pairs; outputs must be distinct
+ * @param options processing applied to every image, and the pool size
+ *                (0 threads means one per hardware core)
+ * @return for each job, whether it was read and written successfully
+ */
+vector<bool> QTree::ProcessBatch(const vector<BatchJob>& jobs, const BatchOptions& options) {
+    unsigned int threads = options.threads;
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
     }
+    threads = (unsigned int)min<size_t>(threads, jobs.size());
+
+    // One byte per job: vector<bool> packs bits, so neighbouring jobs written
+    // from different threads would race
+    vector<char> ok(jobs.size(), 0);
+    atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < jobs.size(); i = next++) {
+            QTree tree(jobs[i].input);
+            if (tree.root == nullptr) {
+                continue;
+            }
 
-    if (IsLeaf(node)) {
-        // If the node is a leaf, draw the rectangle it represents.
-        // The rectangle's top-left corner is scaled up by 'scale' from the node's 'upLeft'.
-        // The rectangle's bottom-right corner is 'lowRight', also scaled.
-        for (unsigned int x = node->upLeft.first * scale; x < (node->lowRight.first + 1) * scale; x++) {
-            for (unsigned int y = node->upLeft.second * scale; y < (node->lowRight.second + 1) * scale; y++) {
-                // Ensure we don't go out of the canvas bounds.
-                if (x < canvas.width() && y < canvas.height()) {
-                    RGBAPixel* pixel = canvas.getPixel(x, y);
-                    *pixel = node->avg;
-                }
+            if (options.pruneTolerance >= 0) {
+                tree.Prune(options.pruneTolerance);
             }
+            if (options.flipHorizontal) {
+                tree.FlipHorizontal();
+            }
+            for (unsigned int r = 0; r < options.rotations % 4; r++) {
+                tree.RotateCCW();
+            }
+
+            ok[i] = tree.WriteRender(jobs[i].output, options.scale);
         }
-    } else {
-        // Recursively render the children nodes.
-        // The children nodes are responsible for drawing their respective quadrants.
-        RenderNode(node->NW, scale, canvas);
-        RenderNode(node->NE, scale, canvas);
-        RenderNode(node->SW, scale, canvas);
-        RenderNode(node->SE, scale, canvas);
+    };
+
+    vector<thread> pool;
+    for (unsigned int t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker(); // the calling thread is part of the pool
+    for (thread& t : pool) {
+        t.join();
+    }
+
+    return vector<bool>(ok.begin(), ok.end());
+}
+
+
+/**
+ * Builds a QTree from img on a background thread.
+ *
+ * control.progress (if set) is called periodically with (nodes built,
+ * estimated total), and control.cancel (if set) is polled at every subtree.
+ * On cancellation every node built so far is freed and the future yields
+ * nullptr.
+ *
+ * @param img image to build from; must stay alive until the future is ready
+ * @param control progress callback and cancellation flag
+ * @return future holding the finished tree, or nullptr if cancelled
+ */
+future<unique_ptr<QTree>> QTree::BuildAsync(const PNG& img, TaskControl control) {
+    return async(launch::async, [&img, control]() -> unique_ptr<QTree> {
+        TaskMonitor monitor{control, EstimateNodeCount(img.width(), img.height()), 0};
+        unique_ptr<QTree> tree(new QTree(img, monitor));
+        if (monitor.Cancelled()) {
+            return nullptr;
+        }
+        monitor.Finish();
+        return tree;
+    });
+}
+
+// Private constructor behind BuildAsync; leaves an empty tree if cancelled
+QTree::QTree(const PNG& imIn, TaskMonitor& monitor) {
+    width = imIn.width();
+    height = imIn.height();
+    root = BuildRegion(PNGSource{imIn}, make_pair(0u, 0u), make_pair(width - 1, height - 1), &monitor);
+    if (root == nullptr) {
+        width = 0;
+        height = 0;
     }
+    Touch();
+}
+
+/**
+ * Prune(tolerance) on a background thread, with progress and cancellation
+ * as in BuildAsync. A cancelled prune stops at the next subtree boundary;
+ * subtrees already collapsed stay collapsed and the tree remains valid.
+ * The tree must not be used by anyone else until the future is ready.
+ *
+ * @return future holding true if the prune ran to completion
+ */
+future<bool> QTree::PruneAsync(double tolerance, TaskControl control) {
+    return async(launch::async, [this, tolerance, control]() {
+        TaskMonitor monitor{control, EstimateNodeCount(width, height), 0};
+        MaterializeColorTransform();
+        PruneNode(root, tolerance, &monitor);
+        Touch();
+        if (monitor.Cancelled()) {
+            return false;
+        }
+        monitor.Finish();
+        return true;
+    });
+}
+
+/**
+ * Render(scale) on a background thread, with progress and cancellation as
+ * in BuildAsync. On cancellation the partial canvas is freed and the future
+ * yields nullptr. The tree must not be modified until the future is ready.
+ *
+ * @return future holding the rendered image, or nullptr if cancelled
+ */
+future<unique_ptr<PNG>> QTree::RenderAsync(unsigned int scale, TaskControl control) const {
+    return async(launch::async, [this, scale, control]() -> unique_ptr<PNG> {
+        TaskMonitor monitor{control, EstimateNodeCount(width, height), 0};
+        unique_ptr<PNG> canvas(new PNG(width * scale, height * scale));
+        RenderNode(root, scale, *canvas, &monitor);
+        if (monitor.Cancelled()) {
+            return nullptr;
+        }
+        monitor.Finish();
+        return canvas;
+    });
 }
 
 
@@ -138,6 +2635,8 @@ void QTree::RenderNode(Node* node, unsigned int scale, PNG& canvas) const {
  *  NOTE - you may use the distanceTo function found in RGBAPixel.h
  *  Pruning criteria should be evaluated on the original tree, not
  *  on any pruned subtree. (we only expect that trees would be pruned once.)
+ *  On a tree laid out by Compact(), the pruned nodes stay allocated in its
+ *  block until the next Compact() or Clear().
  *
  * You may want a recursive helper function for this one.
  *
@@ -145,77 +2644,203 @@ void QTree::RenderNode(Node* node, unsigned int scale, PNG& canvas) const {
  * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
  */
 void QTree::Prune(double tolerance) {
+    // Tolerances apply to the colors as they are displayed
+    MaterializeColorTransform();
+
     // Start pruning from the root
     PruneNode(root, tolerance);
+    Touch();
 }
 
-void QTree::PruneNode(Node*& node, double tolerance) {
-    if (node == nullptr) {
-        return; // If the node is null, there's nothing to prune
-    }
+void QTree::PruneNode(Node*& node, double tolerance, TaskMonitor* monitor) {
+    // Children are pruned before their parent is considered
+    PostOrder(node, [&](Node* current) {
+        // Stop once cancelled; no ancestor of a partly visited subtree is
+        // collapsed, so the tree stays valid
+        if (monitor != nullptr) {
+            if (monitor->Cancelled()) {
+                return false;
+            }
+            monitor->Step();
+        }
 
-    // If the node is a leaf, there's no need to prune further
-    if (IsLeaf(node)) {
-        return;
-    }
+        // Check if we can prune this node after attempting to prune its children
+        if (!IsLeaf(current) && CanPrune(current, current->avg, tolerance)) {
+            // Prune the children nodes
+            ClearSubtree(current->NW);
+            ClearSubtree(current->NE);
+            ClearSubtree(current->SW);
+            ClearSubtree(current->SE);
+        }
+        return true;
+    });
+}
 
-    // Recursively attempt to prune child nodes first
-    PruneNode(node->NW, tolerance);
-    PruneNode(node->NE, tolerance);
-    PruneNode(node->SW, tolerance);
-    PruneNode(node->SE, tolerance);
+/**
+ * Prune restricted to the rectangle [ul, lr]: only subtrees lying entirely
+ * inside it are candidates for pruning, with the usual criterion, and
+ * subtrees that don't intersect it are never visited, so the cost scales
+ * with the region rather than the whole tree.
+ *
+ * @param tolerance maximum RGBA distance to qualify for pruning
+ * @param ul upper left corner of the region
+ * @param lr lower right corner of the region (inclusive)
+ */
+void QTree::Prune(double tolerance, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+    Prune(vector<PruneRegion>(1, PruneRegion{ul, lr, tolerance}));
+}
 
-    // Check if we can prune this node after attempting to prune its children
-    if (CanPrune(node, node->avg, tolerance)) {
-        // Prune the children nodes
-        ClearSubtree(node->NW);
-        ClearSubtree(node->NE);
-        ClearSubtree(node->SW);
-        ClearSubtree(node->SE);
-    }
+/**
+ * Prune with a tolerance map: each region carries its own tolerance. A
+ * subtree is a candidate if it lies entirely inside some region, and is
+ * judged with the tolerance of the first such region in the list; subtrees
+ * intersecting no region are skipped. As with Prune(tolerance), nodes
+ * pruned from a compacted tree are only reclaimed by the next Compact() or
+ * Clear().
+ *
+ * @param regions rectangles with their tolerances, in priority order
+ */
+void QTree::Prune(const vector<PruneRegion>& regions) {
+    // Tolerances apply to the colors as they are displayed
+    MaterializeColorTransform();
+
+    PruneRegionNode(root, regions);
+    Touch();
 }
 
-bool QTree::CanPrune(Node* node, RGBAPixel avgColor, double tolerance) const {
-    if (node == nullptr) {
-        return true; // A null node is considered prunable
-    }
+void QTree::PruneRegionNode(Node* node, const vector<PruneRegion>& regions) {
+    // First region wholly containing current, or null
+    auto containing = [&](const Node* current) -> const PruneRegion* {
+        for (const PruneRegion& region : regions) {
+            if (region.upLeft.first <= current->upLeft.first && current->lowRight.first <= region.lowRight.first &&
+                region.upLeft.second <= current->upLeft.second && current->lowRight.second <= region.lowRight.second) {
+                return &region;
+            }
+        }
+        return nullptr;
+    };
 
-    if (IsLeaf(node)) {
-        // Check color distance for leaf nodes
-        return node->avg.distanceTo(avgColor) <= tolerance;
-    }
+    // Same order as PruneNode: children first, then this node
+    DepthFirst(node, [&](Node* current) {
+        if (IsLeaf(current)) {
+            return Walk::Skip;
+        }
+        for (const PruneRegion& region : regions) {
+            if (region.lowRight.first >= current->upLeft.first && region.upLeft.first <= current->lowRight.first &&
+                region.lowRight.second >= current->upLeft.second && region.upLeft.second <= current->lowRight.second) {
+                return Walk::Descend;
+            }
+        }
+        return Walk::Skip; // nothing below can be a candidate
+    }, [&](Node* current) {
+        const PruneRegion* inside = containing(current);
+        if (inside != nullptr && CanPrune(current, current->avg, inside->tolerance)) {
+            ClearSubtree(current->NW);
+            ClearSubtree(current->NE);
+            ClearSubtree(current->SW);
+            ClearSubtree(current->SE);
+        }
+    });
+}
 
-    // Check if all children are prunable
-    return CanPrune(node->NW, avgColor, tolerance) &&
-           CanPrune(node->NE, avgColor, tolerance) &&
-           CanPrune(node->SW, avgColor, tolerance) &&
-           CanPrune(node->SE, avgColor, tolerance);
+bool QTree::CanPrune(Node* node, RGBAPixel avgColor, double tolerance) const {
+    // A null node is considered prunable; otherwise every leaf below must
+    // be within tolerance, and the walk stops at the first that isn't
+    return PreOrder(node, [&](Node* current) {
+        if (IsLeaf(current) && current->avg.distanceTo(avgColor) > tolerance) {
+            return Walk::Stop;
+        }
+        return Walk::Descend;
+    });
 }
 
-bool QTree::IsLeaf(Node* node) const {
+bool QTree::IsLeaf(const Node* node) const {
     return node != nullptr &&
            node->NW == nullptr && node->NE == nullptr &&
            node->SW == nullptr && node->SE == nullptr;
 }
 
 void QTree::ClearSubtree(Node*& node) {
-    if (node == nullptr) {
-        return; // No need to clear if the node is already null
-    }
-
-    // Recursively clear children
-    ClearSubtree(node->NW);
-    ClearSubtree(node->NE);
-    ClearSubtree(node->SW);
-    ClearSubtree(node->SE);
+    // Children are freed before their parent
+    PostOrder(node, [this](Node* current) {
+        FreeNode(current);
+        return true;
+    });
 
-    // Delete the node and set it to null to prevent access to deleted memory
-    delete node;
+    // Set it to null to prevent access to deleted memory
     node = nullptr;
 }
 
 
 
+/**
+ * Paints the rectangle [ul, lr] of the image in a single color, e.g. for
+ * redaction, without rebuilding the tree. Subtrees lying entirely inside
+ * the rectangle are collapsed into one leaf of that color (their nodes are
+ * freed); the descent only continues through nodes straddling the
+ * rectangle's border, and the averages of those nodes are recomputed from
+ * their children on the way back up, exactly as BuildNode computes them.
+ * A (pruned) leaf straddling the border is first split by the usual
+ * midpoint rule. The cost is therefore O(perimeter x depth). Collapsed
+ * nodes that Compact() placed in its block are not freed one by one; their
+ * memory comes back at the next Compact() or Clear().
+ *
+ * @param ul upper left corner of the rectangle
+ * @param lr lower right corner of the rectangle (inclusive)
+ * @param color the fill color
+ * @pre ul.first <= lr.first, ul.second <= lr.second
+ */
+void QTree::Fill(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, RGBAPixel color) {
+    // The fill color is a displayed color
+    MaterializeColorTransform();
+
+    FillNode(root, ul, lr, color);
+    Touch();
+}
+
+void QTree::FillNode(Node* node, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                     const RGBAPixel& color) {
+    DepthFirst(node, [&](Node* current) {
+        // Disjoint from the fill: untouched
+        if (lr.first < current->upLeft.first || ul.first > current->lowRight.first ||
+            lr.second < current->upLeft.second || ul.second > current->lowRight.second) {
+            return Walk::Skip;
+        }
+
+        // Entirely inside the fill: collapse into a single leaf
+        if (ul.first <= current->upLeft.first && current->lowRight.first <= lr.first &&
+            ul.second <= current->upLeft.second && current->lowRight.second <= lr.second) {
+            ClearSubtree(current->NW);
+            ClearSubtree(current->NE);
+            ClearSubtree(current->SW);
+            ClearSubtree(current->SE);
+            current->avg = color;
+            return Walk::Skip;
+        }
+
+        // Straddles the border. A leaf here covers more than one pixel, so
+        // split it into uniformly colored quadrants before descending.
+        if (IsLeaf(current)) {
+            SplitLeaf(current);
+        }
+        return Walk::Descend;
+    }, [this](Node* current) {
+        current->avg = CalculateAverageColor(current->NW, current->NE, current->SW, current->SE);
+    });
+}
+
+// Gives a leaf covering more than one pixel its quadrants under the
+// midpoint split, each a leaf of the same color
+void QTree::SplitLeaf(Node* node) {
+    for (unsigned int q = 0; q < 4; q++) {
+        pair<unsigned int, unsigned int> childUL, childLR;
+        if (ChildRegion(node->upLeft, node->lowRight, q, childUL, childLR)) {
+            ChildAt(node, q) = new Node(childUL, childLR, node->avg);
+        }
+    }
+}
+
+
 /**
  *  FlipHorizontal rearranges the contents of the tree, so that
  *  its rendered image will appear mirrored across a vertical axis.
@@ -232,28 +2857,22 @@ void QTree::ClearSubtree(Node*& node) {
  */
 void QTree::FlipHorizontal() {
     FlipNodeHorizontal(root);
+    Touch();
 }
 
 void QTree::FlipNodeHorizontal(Node* node) {
-    if (node == nullptr) {
-        return; // Base case: if the node is null, there's nothing to flip
-    }
-
-    // Swap the child nodes horizontally
-    std::swap(node->NW, node->NE);
-    std::swap(node->SW, node->SE);
-
-    // Update the coordinates of the children to reflect the horizontal flip
-    UpdateCoordinatesAfterFlip(node->NW);
-    UpdateCoordinatesAfterFlip(node->NE);
-    UpdateCoordinatesAfterFlip(node->SW);
-    UpdateCoordinatesAfterFlip(node->SE);
-
-    // Recursively flip the child subtrees
-    FlipNodeHorizontal(node->NW);
-    FlipNodeHorizontal(node->NE);
-    FlipNodeHorizontal(node->SW);
-    FlipNodeHorizontal(node->SE);
+    PreOrder(node, [this](Node* current) {
+        // Swap the child nodes horizontally
+        std::swap(current->NW, current->NE);
+        std::swap(current->SW, current->SE);
+
+        // Update the coordinates of the children to reflect the horizontal flip
+        UpdateCoordinatesAfterFlip(current->NW);
+        UpdateCoordinatesAfterFlip(current->NE);
+        UpdateCoordinatesAfterFlip(current->SW);
+        UpdateCoordinatesAfterFlip(current->SE);
+        return Walk::Descend;
+    });
 }
 
 void QTree::UpdateCoordinatesAfterFlip(Node* node) {
@@ -290,41 +2909,182 @@ void QTree::UpdateCoordinatesAfterFlip(Node* node) {
  *  You may want a recursive helper function for this one.
  */
 void QTree::RotateCCW() {
+    unsigned int oldWidth = width;
+
     // Swap the dimensions of the entire image
     std::swap(width, height);
-    RotateNodeCCW(root, {0, 0}, {width - 1, height - 1});
+    RotateNodeCCW(root, oldWidth);
+    Touch();
 }
 
-void QTree::RotateNodeCCW(Node* node, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
-    if (node == nullptr) {
-        return; // Base case: if the node is null, there's nothing to rotate
+void QTree::RotateNodeCCW(Node* node, unsigned int oldWidth) {
+    PreOrder(node, [oldWidth](Node* current) {
+        // Rotate the node's children counterclockwise: the east half
+        // becomes the north half
+        Node* temp = current->NW;
+        current->NW = current->NE;
+        current->NE = current->SE;
+        current->SE = current->SW;
+        current->SW = temp;
+
+        // Pixel (x, y) moves to (y, oldWidth - 1 - x)
+        pair<unsigned int, unsigned int> ul = current->upLeft;
+        pair<unsigned int, unsigned int> lr = current->lowRight;
+        current->upLeft = {ul.second, oldWidth - 1 - lr.first};
+        current->lowRight = {lr.second, oldWidth - 1 - ul.first};
+        return Walk::Descend;
+    });
+}
+
+
+
+
+
+/**
+ * Moves every node of the tree into one contiguous block laid out in van
+ * Emde Boas order: the top half of the tree's levels is stored first,
+ * recursively in the same order, followed by each subtree hanging below
+ * it. A root-to-leaf descent then touches O(log_B n) blocks for any block
+ * size B, so it stays cache- and page-friendly without knowing either.
+ * The tree's contents are unchanged. Nodes added later by Fill live on the
+ * heap as usual until the next Compact, and nodes that Prune or Fill later
+ * remove from the block keep their slots until the next Compact or Clear.
+ */
+void QTree::Compact() {
+    if (root == nullptr) {
+        return;
     }
 
-    // Rotate the node's children counterclockwise
-    Node* temp = node->NW;
-    node->NW = node->SW;
-    node->SW = node->SE;
-    node->SE = node->NE;
-    node->NE = temp;
+    // The slot of each node in the new block is its index in order
+    vector<Node*> order;
+    VebOrder(root, TreeHeight(root), order);
+
+    // Copy into the new block, children still pointing at the old nodes,
+    // and leave each old node's new address in its NW link, which its copy
+    // no longer needs. The block is reserved up front so the copies never
+    // move.
+    vector<Node> block;
+    block.reserve(order.size());
+    for (Node* node : order) {
+        block.push_back(*node);
+        node->NW = &block.back();
+    }
 
-    // Calculate new boundaries after rotation
-    unsigned int midX = (ul.first + lr.first) / 2;
-    unsigned int midY = (ul.second + lr.second) / 2;
+    // Point every copy's children at their copies. An old node is reached
+    // only from its parent, so it is released as soon as its address has
+    // been read: heap nodes individually, the previous block (if any) all
+    // at once below.
+    for (Node& copy : block) {
+        for (unsigned int q = 0; q < 4; q++) {
+            Node*& child = ChildAt(&copy, q);
+            if (child != nullptr) {
+                Node* old = child;
+                child = old->NW;
+                FreeNode(old);
+            }
+        }
+    }
+    FreeNode(root);
 
-    // Update the coordinates of the children to reflect the new layout
-    if (node->NW) RotateNodeCCW(node->NW, {ul.second, lr.first - midX}, {midY, lr.first});
-    if (node->NE) RotateNodeCCW(node->NE, {ul.second, ul.first}, {midY, lr.first - midX});
-    if (node->SW) RotateNodeCCW(node->SW, {midY + 1, lr.first - midX}, {lr.second, lr.first});
-    if (node->SE) RotateNodeCCW(node->SE, {midY + 1, ul.first}, {lr.second, lr.first - midX});
+#if defined(__GLIBC__)
+    // glibc keeps the freed nodes in its fast bins and merges them on the
+    // next large allocation, whatever makes it; merge them (and return
+    // what it can to the system) here, where the cost belongs
+    malloc_trim(0);
+#endif
 
-    // Update the node's coordinates
-    node->upLeft = {ul.second, lr.first - (lr.first - ul.first)};
-    node->lowRight = {lr.second, lr.first - (ul.first)};
+    arena.swap(block);
+    root = &arena[0];
 }
 
+// Appends the nodes of the top h levels of node's subtree (node being the
+// first level) in van Emde Boas order: the top h / 2 levels laid out that
+// way, then each subtree hanging below them, left to right, down to the
+// remaining levels. Each pending layout is a frame whose cursor finds the
+// roots of its bottom subtrees; every frame pushed has at most half (rounded
+// up) the height of the one below it, so from MaxTreeDepth levels no more
+// than VebFrames are ever pending.
+void QTree::VebOrder(Node* node, unsigned int h, vector<Node*>& order) const {
+    struct Frame {
+        Node* node;
+        unsigned int h;
+        bool split;                // the top half is laid out
+        MutableNodeCursor bottoms; // walks down to the bottom subtrees' roots
+    };
+    const unsigned int VebFrames = 8;
+    Frame frames[VebFrames];
+    unsigned int count = 0;
+
+    // One or two levels are laid out directly: the node, then its children
+    auto place = [&](Node* top, unsigned int levels) {
+        order.push_back(top);
+        if (levels == 1) {
+            return;
+        }
+        for (unsigned int q = 0; q < 4; q++) {
+            if (ChildAt(top, q) != nullptr) {
+                order.push_back(ChildAt(top, q));
+            }
+        }
+    };
+    auto push = [&](Node* top, unsigned int levels) {
+        if (levels <= 2) {
+            place(top, levels);
+            return;
+        }
+        frames[count].node = top;
+        frames[count].h = levels;
+        frames[count].split = false;
+        count++;
+    };
+
+    if (node == nullptr || h == 0) {
+        return;
+    }
+    push(node, h);
+    while (count > 0) {
+        Frame& frame = frames[count - 1];
+        unsigned int top = frame.h / 2;
+        if (!frame.split) {
+            frame.split = true;
+            frame.bottoms = MutableNodeCursor(frame.node, NodeOrder::PreOrder);
+            push(frame.node, top);
+            continue;
+        }
 
+        // The next root of a bottom subtree: a node exactly top levels down
+        Node* bottom = frame.bottoms.Next();
+        while (bottom != nullptr && frame.bottoms.Depth() < top) {
+            bottom = frame.bottoms.Next();
+        }
+        if (bottom == nullptr) {
+            count--;
+            continue;
+        }
+        frame.bottoms.Skip();
+        push(bottom, frame.h - top);
+    }
+}
 
+// Number of levels in node's subtree (a single leaf has one)
+unsigned int QTree::TreeHeight(Node* node) const {
+    unsigned int h = 0;
+    NodeCursor cursor(node, NodeOrder::PreOrder);
+    for (const Node* current = cursor.Next(); current != nullptr; current = cursor.Next()) {
+        h = max(h, cursor.Depth() + 1);
+    }
+    return h;
+}
 
+// Deletes a heap-allocated node; nodes living in the Compact block are
+// released with the block instead
+void QTree::FreeNode(Node* node) {
+    less<const Node*> before;
+    if (!arena.empty() && !before(node, arena.data()) && before(node, arena.data() + arena.size())) {
+        return;
+    }
+    delete node;
+}
 
 /**
  * Destroys all dynamically allocated memory associated with the
@@ -339,22 +3099,23 @@ void QTree::Clear() {
     root = nullptr;
     width = 0;
     height = 0;
-}
+    arena.clear();
 
-// Recursive helper function for clearing the tree
-void QTree::ClearNode(Node* node) {
-    if (node == nullptr) {
-        return;
+    {
+        lock_guard<mutex> lock(wideLock);
+        wide.reset();
     }
+    lock_guard<mutex> lock(histogramCacheLock);
+    histogramCache.reset();
+}
 
-    // Recursively clear children
-    ClearNode(node->NW);
-    ClearNode(node->NE);
-    ClearNode(node->SW);
-    ClearNode(node->SE);
-
-    // Delete the current node
-    delete node;
+// Helper function for clearing the tree
+void QTree::ClearNode(Node* node) {
+    // Children are freed before their parent
+    PostOrder(node, [this](Node* current) {
+        FreeNode(current);
+        return true;
+    });
 }
 
 
@@ -371,86 +3132,137 @@ void QTree::Copy(const QTree& other) {
 
     // Deep copy the tree structure
     root = CopyNode(other.root);
+    colorTransform = other.colorTransform;
+    transformPending = other.transformPending;
+
+    // The copy will be edited independently, so it gets its own version
+    Touch();
 }
 
-// Recursive helper function to copy nodes
+// Helper function to copy nodes, in preorder
 Node* QTree::CopyNode(Node* otherNode) {
-    if (otherNode == nullptr) {
-        return nullptr;
+    Node* copy = nullptr;
+
+    // copies[d] is the copy of the source node last reached at depth d, the
+    // parent of whatever the cursor returns at depth d + 1
+    Node* copies[MaxTreeDepth];
+    NodeCursor cursor(otherNode, NodeOrder::PreOrder);
+    for (const Node* source = cursor.Next(); source != nullptr; source = cursor.Next()) {
+        // Create a new node with the same data as the source
+        Node* newNode = new Node(source->upLeft, source->lowRight, source->avg);
+        unsigned int depth = cursor.Depth();
+        if (depth == 0) {
+            copy = newNode;
+        } else {
+            ChildAt(copies[depth - 1], cursor.Quadrant()) = newNode;
+        }
+        copies[depth] = newNode;
     }
 
-    // Create a new node with the same data as otherNode
-    Node* newNode = new Node(otherNode->upLeft, otherNode->lowRight, otherNode->avg);
-
-    // Recursively copy children
-    newNode->NW = CopyNode(otherNode->NW);
-    newNode->NE = CopyNode(otherNode->NE);
-    newNode->SW = CopyNode(otherNode->SW);
-    newNode->SE = CopyNode(otherNode->SE);
-
-    return newNode;
+    return copy;
 }
 
 
 /**
- * Private helper function for the constructor. Recursively builds
+ * Private helper function for the constructor. Builds
  * the tree according to the specification of the constructor.
  * @param img reference to the original input image.
  * @param ul upper left point of current node's rectangle.
  * @param lr lower right point of current node's rectangle.
  */
 Node* QTree::BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
-    // Base case: single pixel region
-    if (ul == lr) {
-        RGBAPixel* pixel = img.getPixel(ul.first, ul.second);
-        return new Node(ul, lr, *pixel);
-    }
-
-    // Calculate midpoints for splitting
-    unsigned int midX = (ul.first + lr.first) / 2;
-    unsigned int midY = (ul.second + lr.second) / 2;
-
-    // Initialize child nodes
-    Node *NW, *NE, *SW, *SE;
-    NW = NE = SW = SE = nullptr;
-
-    // Recursively create child nodes if they are within bounds
-    if (ul.first <= midX && ul.second <= midY) // Check if NW child should exist
-        NW = BuildNode(img, ul, {midX, midY});
+    return BuildRegion(PNGSource{img}, ul, lr);
+}
 
-    if (midX + 1 <= lr.first && ul.second <= midY) // Check if NE child should exist
-        NE = BuildNode(img, {midX + 1, ul.second}, {lr.first, midY});
+/**
+ * Builds the subtree for the rectangle [ul, lr], reading leaf colors
+ * through src(x, y). Used by the PNG constructor and BuildAsync.
+ */
+template <typename Source>
+Node* QTree::BuildRegion(const Source& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                         TaskMonitor* monitor) {
+    // Every region is split into its quadrants on the way down and gets
+    // its averaged color on the way back up, once its children have theirs
+    Node* built = new Node(ul, lr, RGBAPixel());
+    bool finished = DepthFirst(built, [&](Node* current) {
+        // Stop at subtree boundaries once cancelled
+        if (monitor != nullptr) {
+            if (monitor->Cancelled()) {
+                return Walk::Stop;
+            }
+            monitor->Step();
+        }
 
-    if (ul.first <= midX && midY + 1 <= lr.second) // Check if SW child should exist
-        SW = BuildNode(img, {ul.first, midY + 1}, {midX, lr.second});
+        // Base case: single pixel region
+        if (current->upLeft == current->lowRight) {
+            current->avg = src(current->upLeft.first, current->upLeft.second);
+            return Walk::Skip;
+        }
+        SplitLeaf(current);
+        return Walk::Descend;
+    }, [this](Node* current) {
+        // Create the current node's color from its children
+        current->avg = CalculateAverageColor(current->NW, current->NE, current->SW, current->SE);
+    });
+
+    // A cancelled build has nodes whose colors were never computed; free
+    // them so the caller only ever sees a complete tree or nothing
+    if (!finished) {
+        ClearSubtree(built);
+    }
 
-    if (midX + 1 <= lr.first && midY + 1 <= lr.second) // Check if SE child should exist
-        SE = BuildNode(img, {midX + 1, midY + 1}, lr);
+    return built;
+}
 
-    // Create the current node with averaged color from children
-    RGBAPixel avgColor = CalculateAverageColor(NW, NE, SW, SE);
-    Node* node = new Node(ul, lr, avgColor);
-    node->NW = NW;
-    node->NE = NE;
-    node->SW = SW;
-    node->SE = SE;
+/**
+ * Private helper for the streaming and raw-buffer constructors. Builds the
+ * tree for a w x h image, reading it from stream strictly top to bottom.
+ *
+ * Each row y is one walk from the root that only enters the nodes crossing
+ * that row. A node is split into its quadrants the first time a walk
+ * reaches it, which is at its top row; a single-pixel node takes its color
+ * from row y; and a node whose bottom row is y averages its children as the
+ * walk leaves it, their own bottom rows being y or above. Every row is
+ * therefore read exactly once, in order, and only while its walk runs. The
+ * rectangles and colors are the same as BuildNode's.
+ *
+ * @param stream scanline source
+ * @param w width of the image
+ * @param h height of the image
+ */
+Node* QTree::BuildRows(RowStream& stream, unsigned int w, unsigned int h) {
+    Node* built = new Node(make_pair(0u, 0u), make_pair(w - 1, h - 1), RGBAPixel());
+    for (unsigned int y = 0; y < h; y++) {
+        DepthFirst(built, [&](Node* current) {
+            if (current->upLeft.second > y || current->lowRight.second < y) {
+                return Walk::Skip;
+            }
+            if (current->upLeft == current->lowRight) {
+                current->avg = stream.Pixel(current->upLeft.first, y);
+                return Walk::Skip;
+            }
+            if (IsLeaf(current)) {
+                SplitLeaf(current);
+            }
+            return Walk::Descend;
+        }, [&](Node* current) {
+            if (current->lowRight.second == y) {
+                current->avg = CalculateAverageColor(current->NW, current->NE, current->SW, current->SE);
+            }
+        });
+    }
 
-    return node;
+    return built;
 }
 
 RGBAPixel QTree::CalculateAverageColor(Node* NW, Node* NE, Node* SW, Node* SE) {
-    // Initialize color sums and pixel count
-    unsigned int sumRed = 0, sumGreen = 0, sumBlue = 0, pixelCount = 0;
+    // Initialize area-weighted color sums
+    ColorSum sum;
 
     // Helper function to add color values from a node if it is not null
     auto addColor = [&](Node* node) {
         if (node) {
-            unsigned int nodePixelCount = (node->lowRight.first - node->upLeft.first + 1) * 
-                                          (node->lowRight.second - node->upLeft.second + 1);
-            sumRed += node->avg.r * nodePixelCount;
-            sumGreen += node->avg.g * nodePixelCount;
-            sumBlue += node->avg.b * nodePixelCount;
-            pixelCount += nodePixelCount;
+            AddColor(sum, node->avg, RectArea(node->upLeft, node->lowRight));
         }
     };
 
@@ -462,10 +3274,8 @@ RGBAPixel QTree::CalculateAverageColor(Node* NW, Node* NE, Node* SW, Node* SE) {
 
     // Calculate the average color
     RGBAPixel avgColor;
-    if (pixelCount > 0) {
-        avgColor.r = sumRed / pixelCount;
-        avgColor.g = sumGreen / pixelCount;
-        avgColor.b = sumBlue / pixelCount;
+    if (sum.count > 0) {
+        avgColor = AverageColor(sum);
     } else {
         // If there are no children, this means we're at a leaf or pruned node.
         // The average color is just the node's color. For this, we arbitrarily pick NW.
@@ -0,0 +1,384 @@
+/**
+ * @file qtree.h
+ * @description student definition of QTree class used for storing image data
+ *              CPSC 221 PA3
+ *
+ *              SUBMIT THIS FILE. It declares the public members and
+ *              types added on top of the PA3 interface (they cannot go in
+ *              qtree-private.h, which is included inside QTree's private
+ *              section), so qtree.cpp does not compile against the stock
+ *              header.
+ */
+
+#ifndef _QTREE_H_
+#define _QTREE_H_
+
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+// Layout of one pixel in a PixelSpan. RGBA16 has four native-endian
+// 16-bit channels and RGBA32F four floats in 0..1 (out-of-range values,
+// e.g. HDR highlights, are clamped).
+enum class PixelFormat { RGBA8, BGRA8, RGB8, RGBA16, RGBA32F };
+
+// Read-only view of a caller-owned, row-strided pixel buffer
+struct PixelSpan {
+    const unsigned char* data; // first byte of the top row
+    unsigned int width;
+    unsigned int height;
+    size_t stride;             // bytes from the start of one row to the next
+    PixelFormat format;
+};
+
+// One input/output file pair for QTree::ProcessBatch
+struct BatchJob {
+    string input;
+    string output;
+};
+
+// Processing applied by QTree::ProcessBatch to every job
+struct BatchOptions {
+    double pruneTolerance = -1; // negative: don't prune
+    bool flipHorizontal = false;
+    unsigned int rotations = 0; // counter-clockwise quarter turns
+    unsigned int scale = 1;
+    unsigned int threads = 0;   // worker threads; 0 means one per hardware core
+};
+
+// Progress reporting and cancellation for the async operations; both
+// members are optional
+struct TaskControl {
+    const atomic<bool>* cancel = nullptr;
+    function<void(uint64_t done, uint64_t total)> progress;
+};
+
+// Output sampling for Render(outW, outH, mode)
+enum class ResampleMode { Nearest, Box };
+
+// An axis-aligned rectangle of one color, corners inclusive
+struct ColorRect {
+    pair<unsigned int, unsigned int> upLeft;
+    pair<unsigned int, unsigned int> lowRight;
+    RGBAPixel color;
+};
+
+// Output order for MergedRects
+enum class RectOrder { Scanline, Morton };
+
+// A horizontal run of one color within an output row
+struct ColorRun {
+    unsigned int x;
+    unsigned int length;
+    RGBAPixel color;
+};
+
+// Result of QTree::ErrorAgainst
+struct ErrorStats {
+    double mse;
+    double psnr; // infinity when mse is 0
+    double ssim;  // all three are NaN if the source's size did not match
+};
+
+// A color adjustment: an affine 3x4 channel mix (applied if mixes) followed
+// by a per-channel lookup table (applied if maps)
+struct ColorTransform {
+    float matrix[3][4];
+    unsigned char lut[3][256];
+    bool mixes;
+    bool maps;
+
+    static ColorTransform Identity();
+    static ColorTransform Brightness(int delta);
+    static ColorTransform Contrast(double factor);
+    static ColorTransform Gamma(double gamma);
+    static ColorTransform Mix(const float m[3][4]);
+    static ColorTransform Lookup(const unsigned char table[3][256]);
+
+    RGBAPixel Apply(const RGBAPixel& p) const;
+};
+
+// A rectangle (corners inclusive) and the prune tolerance used inside it
+struct PruneRegion {
+    pair<unsigned int, unsigned int> upLeft;
+    pair<unsigned int, unsigned int> lowRight;
+    double tolerance;
+};
+
+/**
+ * The Node class is private to the tree class via the principle of
+ * encapsulation---the end user does not need to know our node-based
+ * implementation details.
+ * given for PA3
+ */
+class Node {
+public:
+    Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, RGBAPixel a); // Node constructor
+
+    pair<unsigned int, unsigned int> upLeft;
+    pair<unsigned int, unsigned int> lowRight;
+    RGBAPixel avg;
+    Node* NW; // left top child rectangle
+    Node* NE; // right top child rectangle
+    Node* SW; // left bottom child rectangle
+    Node* SE; // right bottom child rectangle
+};
+
+class QTree;
+
+// One node as seen through QTree::Leaves / QTree::Nodes
+struct NodeView {
+    pair<unsigned int, unsigned int> upLeft;
+    pair<unsigned int, unsigned int> lowRight;
+    RGBAPixel avg; // displayed color, with any pending transform applied
+    unsigned int depth; // the root is at depth 0
+    bool leaf;
+};
+
+// Traversal order for QTree::Nodes
+enum class NodeOrder { PreOrder, PostOrder, LevelOrder };
+
+// Deepest a tree can get: every level halves a 32-bit extent
+const unsigned int MaxTreeDepth = 34;
+
+// Resumable walk over the nodes under a root, in any NodeOrder, keeping one
+// frame per level of the tree and never allocating. The tree's own walks
+// and NodeIterator are all driven by it. NodeT is const Node for walks that
+// only read the tree (NodeCursor) and Node for walks that edit the nodes
+// they reach (MutableNodeCursor); the cursor reads a node's children only
+// once the node has been returned, so they may be changed until then.
+template <typename NodeT>
+class BasicNodeCursor {
+public:
+    BasicNodeCursor();
+    BasicNodeCursor(NodeT* root, NodeOrder order);
+
+    // Moves to the next node and returns it, or nullptr once the walk is over
+    NodeT* Next();
+    // PreOrder only: leaves out the children of the node Next just returned
+    void Skip();
+    // Depth below the root of the node Next just returned (the root is 0)
+    unsigned int Depth() const;
+    // Which child (0 NW, 1 NE, 2 SW, 3 SE) of its parent the node Next just
+    // returned is; 0 for the root
+    unsigned int Quadrant() const;
+
+private:
+    struct Frame {
+        NodeT* node;
+        unsigned int next; // index of the next child to look at
+    };
+
+    NodeT* NextPre();
+    NodeT* NextPost();
+    NodeT* NextLevel();
+
+    NodeT* root;
+    NodeOrder order;
+    bool started;
+    NodeT* current;
+    unsigned int depth;
+    unsigned int quadrant;
+    bool expand;         // PreOrder: walk current's children next
+    unsigned int target; // LevelOrder: depth being listed
+    bool deeper;         // LevelOrder: some node at target has children
+    Frame frames[MaxTreeDepth];
+    unsigned int count;
+};
+
+typedef BasicNodeCursor<const Node> NodeCursor;
+typedef BasicNodeCursor<Node> MutableNodeCursor;
+
+// Iterator over a NodeRange; see QTree::Nodes. Each NodeView is made when
+// the iterator is dereferenced, so it comes back by value and the iterator
+// is an input iterator.
+class NodeIterator {
+public:
+    // What operator-> returns; holds the view it points at
+    struct Arrow {
+        NodeView view;
+        const NodeView* operator->() const { return &view; }
+    };
+
+    typedef input_iterator_tag iterator_category;
+    typedef NodeView value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Arrow pointer;
+    typedef NodeView reference;
+
+    NodeIterator();
+    NodeIterator(const Node* root, NodeOrder order, bool leavesOnly, const ColorTransform* transform);
+
+    reference operator*() const;
+    pointer operator->() const;
+    NodeIterator& operator++();
+    NodeIterator operator++(int);
+    bool operator==(const NodeIterator& other) const;
+    bool operator!=(const NodeIterator& other) const;
+
+private:
+    void Advance();
+
+    NodeCursor cursor;
+    bool leavesOnly;
+    const ColorTransform* transform;
+    const Node* current;
+};
+
+// Range-for view over a tree's nodes; see QTree::Leaves and QTree::Nodes
+class NodeRange {
+public:
+    NodeRange(const Node* root, NodeOrder order, bool leavesOnly, const ColorTransform* transform);
+
+    NodeIterator begin() const;
+    NodeIterator end() const;
+
+private:
+    const Node* root;
+    NodeOrder order;
+    bool leavesOnly;
+    const ColorTransform* transform;
+};
+
+// One tile produced by TileGenerator: its offset in the full render
+struct Tile {
+    unsigned int x;
+    unsigned int y;
+    PNG image;
+};
+
+// Pulls the tiles of a render one at a time; see QTree::RenderTiles
+class TileGenerator {
+public:
+    TileGenerator(const QTree& tree, unsigned int scale, unsigned int tileSize);
+
+    bool Next(Tile& tile);
+
+private:
+    const QTree& tree;
+    unsigned int scale;
+    unsigned int tileSize;
+    uint64_t nextX;
+    uint64_t nextY;
+};
+
+class QTree {
+public:
+    /* =============== start of given functions ====================*/
+
+    /**
+     * Destructor; frees all memory associated with this tree.
+     */
+    ~QTree();
+
+    /**
+     * Copy constructor.
+     */
+    QTree(const QTree& other);
+
+    /**
+     * Overloaded assignment operator.
+     */
+    QTree& operator=(const QTree& rhs);
+
+    /* =============== end of given functions ====================*/
+
+    /* =============== public PA3 FUNCTIONS =========================*/
+
+    QTree(const PNG& imIn);
+    PNG Render(unsigned int scale) const;
+    void Prune(double tolerance);
+    void FlipHorizontal();
+    void RotateCCW();
+
+    QTree(const PixelSpan& span);
+    typedef function<void(unsigned int y, RGBAPixel* row)> RowReader;
+    QTree(unsigned int w, unsigned int h, const RowReader& readRow);
+    QTree(const string& pngFile);
+    bool WriteRender(const string& pngFile, unsigned int scale) const;
+    static vector<bool> ProcessBatch(const vector<BatchJob>& jobs, const BatchOptions& options);
+    static future<unique_ptr<QTree>> BuildAsync(const PNG& img, TaskControl control);
+    future<bool> PruneAsync(double tolerance, TaskControl control);
+    future<unique_ptr<PNG>> RenderAsync(unsigned int scale, TaskControl control) const;
+    PNG RenderTile(unsigned int scale, unsigned int x0, unsigned int y0, unsigned int w, unsigned int h) const;
+    TileGenerator RenderTiles(unsigned int scale, unsigned int tileSize) const;
+    unsigned int MaxZoom(unsigned int tileSize) const;
+    PNG RenderZoomTile(unsigned int zoom, unsigned int tx, unsigned int ty, unsigned int tileSize) const;
+    uint64_t Version() const;
+    vector<PNG> RenderPyramid(unsigned int levels) const;
+    PNG Render(unsigned int outW, unsigned int outH, ResampleMode mode) const;
+    PNG RenderSmooth(unsigned int scale) const;
+    vector<ColorRect> MergedRects(RectOrder order) const;
+    vector<vector<ColorRun>> RenderRuns(unsigned int scale) const;
+    ErrorStats ErrorAgainst(const PNG& source) const;
+    vector<uint64_t> Histogram(unsigned int bins, unsigned int maxDepth = UINT_MAX) const;
+    vector<RGBAPixel> DominantColors(unsigned int k, unsigned int maxDepth = UINT_MAX) const;
+    vector<RGBAPixel> QuantizeColors(unsigned int k);
+    void ApplyColorTransform(const ColorTransform& transform);
+    void MaterializeColorTransform();
+    void Fill(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, RGBAPixel color);
+    void Prune(double tolerance, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+    void Prune(const vector<PruneRegion>& regions);
+    void Compact();
+    void UseWideLayout(bool enable);
+    void UseHistogramCache(bool enable);
+    NodeRange Leaves() const;
+    NodeRange Nodes(NodeOrder order = NodeOrder::PreOrder) const;
+
+    // Reads the tree's dimensions while pulling tiles
+    friend class TileGenerator;
+
+private:
+    Node* root;          // pointer to the root of the QTree
+    unsigned int height; // height of PNG represented by the tree
+    unsigned int width;  // width of PNG represented by the tree
+
+    /* =================== private PA3 functions ============== */
+
+    void Clear();
+    void Copy(const QTree& other);
+    Node* BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+
+    /* =================== If you have any private helper functions, add them here ============== */
+    #include "qtree-private.h"
+};
+
+// Thread-safe LRU cache of PNG-encoded zoom tiles, keyed by tree version
+class TileCache {
+public:
+    TileCache(size_t capacity, unsigned int tileSize);
+
+    bool Get(const QTree& tree, unsigned int zoom, unsigned int tx, unsigned int ty, vector<unsigned char>& png);
+
+private:
+    // (tree version, zoom, tx, ty)
+    typedef tuple<uint64_t, unsigned int, unsigned int, unsigned int> Key;
+
+    size_t capacity;
+    unsigned int tileSize;
+    list<pair<Key, vector<unsigned char>>> entries; // most recently used first
+    map<Key, list<pair<Key, vector<unsigned char>>>::iterator> index;
+    mutex guard;
+};
+
+#endif